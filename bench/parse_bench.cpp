@@ -0,0 +1,166 @@
+// Parser microbenchmark: lines/sec of parse_line() against the old
+// split_pipe_segments + tokenize_space + parse_command_segment chain.
+//
+//   g++ -std=c++17 -O2 bench/parse_bench.cpp -lreadline -o parse_bench
+//   ./parse_bench [--json] [lines-file] [seconds-per-parser]
+#define SHELL_NO_MAIN
+#include "../src/main.cpp"
+
+#include <chrono>
+#include <fstream>
+
+namespace legacy {
+// Verbatim copy of the parser src/main.cpp used before the single-pass lexer.
+std::vector<std::string> split_pipe_segments(const std::string &line) {
+    std::vector<std::string> segments;
+    std::string cur;
+    bool in_quote = false;
+    char quote_char = 0;
+    for (size_t i = 0; i < line.size(); ++i) {
+        char c = line[i];
+        if (!in_quote && (c == '\'' || c == '"')) {
+            in_quote = true; quote_char = c; cur.push_back(c);
+        } else if (in_quote && c == quote_char) {
+            in_quote = false; cur.push_back(c);
+        } else if (!in_quote && c == '|') {
+            segments.push_back(cur);
+            cur.clear();
+        } else {
+            cur.push_back(c);
+        }
+    }
+    if (!cur.empty()) segments.push_back(cur);
+    for (auto &s : segments) {
+        size_t a = s.find_first_not_of(" \t");
+        size_t b = s.find_last_not_of(" \t");
+        s = (a == std::string::npos) ? "" : s.substr(a, b - a + 1);
+    }
+    return segments;
+}
+
+std::vector<std::string> tokenize_space(const std::string &s) {
+    std::vector<std::string> tokens;
+    std::string cur;
+    bool in_quote = false;
+    char qch = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        char c = s[i];
+        if (!in_quote && (c == '"' || c == '\'')) {
+            in_quote = true; qch = c; cur.push_back(c);
+        } else if (in_quote && c == qch) {
+            in_quote = false; cur.push_back(c);
+        } else if (!in_quote && isspace((unsigned char)c)) {
+            if (!cur.empty()) { tokens.push_back(cur); cur.clear(); }
+        } else {
+            cur.push_back(c);
+        }
+    }
+    if (!cur.empty()) tokens.push_back(cur);
+    return tokens;
+}
+
+struct Command {
+    std::vector<char*> argv;
+    std::string infile;
+    std::string outfile;
+    bool append = false;
+};
+
+Command parse_command_segment(const std::string &seg) {
+    Command cmd;
+    auto toks = tokenize_space(seg);
+    for (size_t i = 0; i < toks.size();) {
+        std::string t = toks[i];
+        if (t == "<") {
+            if (i + 1 < toks.size()) cmd.infile = toks[i + 1];
+            i += 2;
+        } else if (t == ">" || t == ">>") {
+            if (t == ">>") cmd.append = true;
+            if (i + 1 < toks.size()) cmd.outfile = toks[i + 1];
+            i += 2;
+        } else {
+            std::string clean = t;
+            if (clean.size() >= 2 && ((clean.front() == '"' && clean.back() == '"') ||
+                (clean.front() == '\'' && clean.back() == '\''))) {
+                clean = clean.substr(1, clean.size() - 2);
+            }
+            cmd.argv.push_back(strdup(clean.c_str()));
+            i++;
+        }
+    }
+    cmd.argv.push_back(nullptr);
+    return cmd;
+}
+
+// What execute_line() used to do with a line before launching it.
+void parse(const std::string &input) {
+    std::string line = input;
+    auto segments = split_pipe_segments(line);
+    if (segments.empty()) return;
+    if (line.back() == '&') {
+        while (!line.empty() && isspace((unsigned char)line.back())) line.pop_back();
+        if (!line.empty() && line.back() == '&') line.pop_back();
+        segments = split_pipe_segments(line);
+    }
+    if (segments.size() == 1 && tokenize_space(segments[0]).empty()) return;
+    std::vector<Command> commands;
+    for (auto &seg : segments) commands.push_back(parse_command_segment(seg));
+    for (auto &c : commands)
+        for (auto p : c.argv) if (p) free(p);
+}
+} // namespace legacy
+
+static const char *default_lines[] = {
+    "ls -la /usr/bin",
+    "grep -n \"launch_pipeline\" src/main.cpp | sort | uniq -c | sort -rn | head -20",
+    "cat access.log | cut -d ' ' -f 1 | sort | uniq -c > /tmp/hits.txt",
+    "make -j8 CFLAGS='-O2 -g' >> build.log &",
+    "echo \"hello world\" 'and more' plain words here",
+    "find . -name '*.cpp' | xargs wc -l | tail -1",
+};
+
+template <typename F>
+static double lines_per_sec(const std::vector<std::string> &lines, double seconds, F parse) {
+    using clock = std::chrono::steady_clock;
+    size_t done = 0;
+    auto start = clock::now();
+    double elapsed = 0;
+    while (elapsed < seconds) {
+        for (auto &l : lines) parse(l);
+        done += lines.size();
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    }
+    return done / elapsed;
+}
+
+int main(int argc, char **argv) {
+    bool as_json = argc >= 2 && strcmp(argv[1], "--json") == 0;
+    if (as_json) { --argc; ++argv; }
+    std::vector<std::string> lines;
+    if (argc >= 2) {
+        std::ifstream in(argv[1]);
+        for (std::string l; std::getline(in, l); ) if (!l.empty()) lines.push_back(l);
+    } else {
+        for (auto l : default_lines) lines.push_back(l);
+    }
+    if (lines.empty()) { std::cerr << "no input lines\n"; return 1; }
+    double seconds = argc >= 3 ? atof(argv[2]) : 1.0;
+
+    double old_rate = lines_per_sec(lines, seconds, legacy::parse);
+    Arena arena;
+    double new_rate = lines_per_sec(lines, seconds, [&arena](const std::string &l) {
+        Pipeline pl;
+        parse_line(l, arena, pl);
+        arena.reset();
+    });
+    if (as_json) {
+        std::cout << "{\"legacy_lines_per_sec\": " << (long)old_rate
+                  << ", \"parse_line_lines_per_sec\": " << (long)new_rate
+                  << ", \"speedup\": " << new_rate / old_rate << "}\n";
+        return 0;
+    }
+    std::cout << "legacy parser: " << (long)old_rate << " lines/s\n";
+    std::cout << "parse_line:    " << (long)new_rate << " lines/s\n";
+    std::cout << "speedup:       " << new_rate / old_rate << "x\n";
+    return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Builds the shell and the benchmarks, runs them, and prints one JSON object:
+#   {"parser": <parse_bench --json>, "shell": <shell_bench>,
+#    "shell_min": <shell_bench --oneshot on the minimal build>}
+#
+# The minimal build (bench/out/shell-min) is static and has no readline:
+# the interactive prompt reads the terminal in cooked mode, without
+# completion or history recall, and everything else behaves the same.
+# glibc warns that ~user lookups need its shared NSS modules at run time.
+#
+#   bench/run.sh [scale]      CXX, CXXFLAGS and BENCH_OUT (default bench/out) are honoured
+set -e
+cd "$(dirname "$0")/.."
+out=${BENCH_OUT:-bench/out}
+cxx=${CXX:-g++}
+flags=${CXXFLAGS:--std=c++17 -O2}
+mkdir -p "$out"
+
+$cxx $flags src/main.cpp -lreadline -o "$out/shell"
+$cxx $flags -DSHELL_NO_READLINE -static src/main.cpp -o "$out/shell-min"
+$cxx $flags bench/parse_bench.cpp -lreadline -o "$out/parse_bench"
+$cxx $flags bench/shell_bench.cpp -lutil -o "$out/shell_bench"
+
+parser=$("$out/parse_bench" --json)
+shell=$("$out/shell_bench" "$out/shell" "${1:-1}")
+shell_min=$("$out/shell_bench" --oneshot "$out/shell-min")
+printf '{"parser": %s, "shell": %s, "shell_min": %s}\n' "$parser" "$shell" "$shell_min"
@@ -0,0 +1,209 @@
+// End-to-end benchmarks against a built shell binary; prints one JSON object
+// so bench/run.sh output can be diffed between revisions.
+//
+//   g++ -std=c++17 -O2 bench/shell_bench.cpp -lutil -o shell_bench
+//   ./shell_bench path/to/shell [scale]
+//   ./shell_bench --oneshot path/to/shell     only oneshot_us
+//
+// cold_start_ms     forkpty + exec until the first prompt is on the terminal
+// oneshot_us        spawn to exit of `shell -c true`, the orchestration case
+// batch_lines_per_sec  builtin-only script lines through parse + dispatch
+// spawn_true_us     per-line cost of a script of `/bin/true` (a path, so not
+//                   the builtin), posix_spawn and fork
+// cat_pipeline      MB/s through n real `cat -` stages (not elided)
+// reap_bg_jobs      launch + reap cost per `/bin/true &`, ended by `wait`
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static std::string shell_path;
+static std::string tmp_dir;
+
+static double now_sec() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string tmp_file(const std::string &name) { return tmp_dir + "/" + name; }
+
+static void write_file(const std::string &path, const std::string &text) {
+    std::ofstream out(path, std::ios::binary);
+    out << text;
+}
+
+// Runs the shell with `args` and stdout and stderr on /dev/null (or a
+// SHELL_SPAWN override) and returns the wall time.
+static double run_shell(std::vector<std::string> args, const char *spawn_mode = nullptr) {
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    std::vector<std::string> env;
+    for (char **e = environ; *e; ++e)
+        if (strncmp(*e, "SHELL_SPAWN=", 12) != 0) env.push_back(*e);
+    if (spawn_mode) env.push_back(std::string("SHELL_SPAWN=") + spawn_mode);
+    std::vector<char*> envp;
+    for (auto &e : env) envp.push_back(&e[0]);
+    envp.push_back(nullptr);
+    std::vector<char*> argv = {&shell_path[0]};
+    for (auto &a : args) argv.push_back(&a[0]);
+    argv.push_back(nullptr);
+
+    double start = now_sec();
+    pid_t pid;
+    if (posix_spawn(&pid, shell_path.c_str(), &fa, nullptr, argv.data(), envp.data()) != 0) {
+        perror("posix_spawn");
+        exit(1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    double elapsed = now_sec() - start;
+    posix_spawn_file_actions_destroy(&fa);
+    return elapsed;
+}
+
+static double run_script(const std::string &script, const char *spawn_mode = nullptr) {
+    return run_shell({script}, spawn_mode);
+}
+
+static std::string repeat_lines(const std::string &line, size_t n) {
+    std::string s;
+    s.reserve((line.size() + 1) * n);
+    for (size_t i = 0; i < n; ++i) s += line + "\n";
+    return s;
+}
+
+// Wall time from fork to the first "$ " on the terminal.
+static double cold_start_once() {
+    int master;
+    double start = now_sec();
+    pid_t pid = forkpty(&master, nullptr, nullptr, nullptr);
+    if (pid < 0) { perror("forkpty"); exit(1); }
+    if (pid == 0) {
+        setenv("HISTFILE", tmp_file("history").c_str(), 1);
+        execl(shell_path.c_str(), shell_path.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    std::string seen;
+    double elapsed = -1;
+    char buf[4096];
+    while (elapsed < 0) {
+        struct pollfd pfd = {master, POLLIN, 0};
+        if (poll(&pfd, 1, 5000) <= 0) break;
+        ssize_t n = read(master, buf, sizeof(buf));
+        if (n <= 0) break;
+        seen.append(buf, n);
+        if (seen.find("$ ") != std::string::npos) elapsed = now_sec() - start;
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    close(master);
+    return elapsed * 1000;
+}
+
+struct Stats { double median, p90, min; };
+
+static Stats summarize(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    return {v[v.size() / 2], v[std::min(v.size() - 1, v.size() * 9 / 10)], v.front()};
+}
+
+static Stats oneshot_us(int runs) {
+    std::vector<double> v;
+    for (int i = 0; i < runs; ++i) v.push_back(run_shell({"-c", "true"}) * 1e6);
+    return summarize(v);
+}
+
+static std::string json(const Stats &s) {
+    std::ostringstream o;
+    o << "{\"median\": " << s.median << ", \"p90\": " << s.p90 << ", \"min\": " << s.min << "}";
+    return o.str();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) { std::cerr << "usage: shell_bench [--oneshot] path/to/shell [scale]\n"; return 2; }
+    if (strcmp(argv[1], "--oneshot") == 0) {
+        if (argc < 3) { std::cerr << "usage: shell_bench --oneshot path/to/shell\n"; return 2; }
+        shell_path = argv[2];
+        std::cout << "{\"oneshot_us\": " << json(oneshot_us(500)) << "}\n";
+        return 0;
+    }
+    shell_path = argv[1];
+    double scale = argc >= 3 ? atof(argv[2]) : 1.0;
+    if (scale <= 0) scale = 1.0;
+    char dir_template[] = "/tmp/shell_bench.XXXXXX";
+    if (!mkdtemp(dir_template)) { perror("mkdtemp"); return 1; }
+    tmp_dir = dir_template;
+    auto scaled = [scale](size_t n) { return std::max<size_t>(1, static_cast<size_t>(n * scale)); };
+
+    std::vector<double> starts;
+    for (int i = 0; i < 20; ++i) {
+        double ms = cold_start_once();
+        if (ms >= 0) starts.push_back(ms);
+    }
+
+    Stats oneshot = oneshot_us(static_cast<int>(scaled(500)));
+
+    size_t builtin_lines = scaled(200000);
+    write_file(tmp_file("builtins.sh"), repeat_lines("set +debug pipebuf=default", builtin_lines));
+    double builtin_time = run_script(tmp_file("builtins.sh"));
+
+    size_t true_lines = scaled(2000);
+    write_file(tmp_file("true.sh"), repeat_lines("/bin/true", true_lines));
+    double spawn_time = run_script(tmp_file("true.sh"), "spawn");
+    double fork_time = run_script(tmp_file("true.sh"), "fork");
+
+    size_t data_mb = scaled(256);
+    {
+        std::string chunk(1 << 20, 'x');
+        std::ofstream data(tmp_file("data"), std::ios::binary);
+        for (size_t i = 0; i < data_mb; ++i) data << chunk;
+    }
+    std::ostringstream cat_json;
+    cat_json << "[";
+    const int stage_counts[] = {1, 2, 4, 8, 16};
+    for (size_t k = 0; k < sizeof(stage_counts) / sizeof(stage_counts[0]); ++k) {
+        std::string line = "cat - < " + tmp_file("data");
+        for (int s = 1; s < stage_counts[k]; ++s) line += " | cat -";
+        write_file(tmp_file("cat.sh"), line + " > /dev/null\n");
+        double t = run_script(tmp_file("cat.sh"));
+        cat_json << (k ? ", " : "") << "{\"stages\": " << stage_counts[k]
+                 << ", \"mb_per_sec\": " << data_mb / t << "}";
+    }
+    cat_json << "]";
+
+    size_t bg_jobs = scaled(500);
+    write_file(tmp_file("bg.sh"), repeat_lines("/bin/true &", bg_jobs) + "wait\n");
+    double bg_time = run_script(tmp_file("bg.sh"));
+
+    std::cout << "{\"cold_start_ms\": " << (starts.empty() ? "null" : json(summarize(starts)))
+              << ", \"oneshot_us\": " << json(oneshot)
+              << ", \"batch_lines_per_sec\": " << builtin_lines / builtin_time
+              << ", \"spawn_true_us\": {\"posix_spawn\": " << spawn_time / true_lines * 1e6
+              << ", \"fork\": " << fork_time / true_lines * 1e6 << "}"
+              << ", \"cat_pipeline\": " << cat_json.str()
+              << ", \"reap_bg_jobs\": {\"jobs\": " << bg_jobs
+              << ", \"us_per_job\": " << bg_time / bg_jobs * 1e6 << "}}\n";
+
+    for (const char *f : {"builtins.sh", "true.sh", "data", "cat.sh", "bg.sh", "history", "history.idx"})
+        unlink(tmp_file(f).c_str());
+    rmdir(tmp_dir.c_str());
+    return 0;
+}
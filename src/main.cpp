@@ -1,11 +1,29 @@
 // SAVE THIS AS ~/projects/custom_shell/src/main.cpp
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <deque>
+#include <list>
 #include <map>
+#include <queue>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <climits>
+#include <unordered_map>
+#include <unordered_set>
+#include <new>
+#include <type_traits>
 #include <sstream>
+#include <iomanip>
 #include <algorithm>
+#include <cstddef>
 #include <cstring>
 #include <cstdlib>
 #include <csignal>
@@ -13,32 +31,234 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <glob.h>
+#include <pwd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/sched.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <spawn.h>
 #include <termios.h>
+#include <time.h>
+// -DSHELL_NO_READLINE builds without readline (see read_input_line), for a
+// static binary that starts as fast as possible; bench/run.sh builds one.
+#ifndef SHELL_NO_READLINE
 #include <readline/readline.h>
 #include <readline/history.h>
+#endif
 
-static int next_job_id = 1;
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct Process {
+    pid_t pid;
+    int pidfd = -1;      // open only while the shell waits on it in the foreground
+    int status = 0;      // waitpid()-style status once done
+    bool done = false;
+    int64_t start_ns = 0;     // CLOCK_MONOTONIC at spawn and at reap,
+    int64_t end_ns = 0;       // for `time`
+    struct rusage ru{};
+    bool stopped = false;
+    int item = -1;       // input index, for processes of a `parallel` job
+};
+
+struct ParallelRun;
 
 struct Job {
     int id;
     pid_t pgid;
+    std::vector<Process> procs;   // one per started pipeline stage, in order
     std::string cmdline;
     bool running;
     bool stopped;
     bool background;
+    size_t live = 0;              // processes not yet reaped
+    bool timed = false;           // report rusage when done (`time` prefix)
+    std::shared_ptr<ParallelRun> run;   // work queue of a `parallel` job
+    std::string cgroup;           // leaf cgroup of a `limit` job, removed with it
+};
+
+static void cgroup_remove(const std::string &path);
+static void telemetry_job_started(const Job &j, int64_t spawn_ns);
+static void telemetry_job_done(const Job &j);
+
+// Stable reference to a job: stays valid across table growth and turns into
+// nullptr once the job is removed, even if its id has been handed out again.
+struct JobHandle {
+    int id = 0;
+    uint32_t gen = 0;
+};
+
+// Jobs live in slot id - 1 and are indexed by pgid and by every member pid,
+// so each lookup the reaper makes is O(1). Freed ids go on a min-heap and the
+// lowest free id is reused. Slots are in a deque, so Job pointers survive
+// growth until that particular job is removed.
+class JobTable {
+public:
+    Job &add(pid_t pgid, const std::vector<pid_t> &pids, const std::string &cmdline, bool background) {
+        int id;
+        if (!free_ids_.empty()) { id = free_ids_.top(); free_ids_.pop(); }
+        else { slots_.emplace_back(); id = static_cast<int>(slots_.size()); }
+        Slot &s = slots_[id - 1];
+        s.used = true;
+        s.gen++;
+        s.job = Job{};
+        s.job.id = id;
+        s.job.pgid = pgid;
+        s.job.cmdline = cmdline;
+        s.job.running = true;
+        s.job.stopped = false;
+        s.job.background = background;
+        if (pgid > 0) by_pgid_[pgid] = id;
+        for (pid_t p : pids) add_process(s.job, p);
+        ++count_;
+        return s.job;
+    }
+
+    Process &add_process(Job &j, pid_t pid) {
+        by_pid_[pid] = ProcRef{j.id, j.procs.size()};
+        j.procs.push_back(Process{pid});
+        j.procs.back().start_ns = now_ns();
+        j.live++;
+        return j.procs.back();
+    }
+
+    // A `parallel` job moves to a new group when its old one has emptied.
+    void set_pgid(Job &j, pid_t pgid) {
+        if (j.pgid > 0) by_pgid_.erase(j.pgid);
+        j.pgid = pgid;
+        if (pgid > 0) by_pgid_[pgid] = j.id;
+    }
+
+    Job *by_id(int id) {
+        if (id < 1 || id > static_cast<int>(slots_.size()) || !slots_[id - 1].used) return nullptr;
+        return &slots_[id - 1].job;
+    }
+    Job *by_pgid(pid_t pgid) {
+        auto it = by_pgid_.find(pgid);
+        return it == by_pgid_.end() ? nullptr : by_id(it->second);
+    }
+    // Also yields the process's index in Job::procs.
+    Job *by_pid(pid_t pid, size_t *index = nullptr) {
+        auto it = by_pid_.find(pid);
+        if (it == by_pid_.end()) return nullptr;
+        if (index) *index = it->second.index;
+        return by_id(it->second.id);
+    }
+
+    JobHandle handle(const Job &j) const { return JobHandle{j.id, slots_[j.id - 1].gen}; }
+    Job *get(JobHandle h) {
+        Job *j = by_id(h.id);
+        return (j && slots_[h.id - 1].gen == h.gen) ? j : nullptr;
+    }
+
+    // Queues a job that has just finished for the next remove_finished().
+    void finished(const Job &j) { finished_.push_back(j.id); }
+
+    void remove_finished() {
+        for (int id : finished_) {
+            Job *j = by_id(id);
+            if (!j || j->running || j->stopped) continue;
+            if (j->pgid > 0) by_pgid_.erase(j->pgid);
+            for (auto &p : j->procs) by_pid_.erase(p.pid);
+            if (!j->cgroup.empty()) cgroup_remove(j->cgroup);
+            slots_[id - 1].used = false;
+            slots_[id - 1].job = Job();
+            free_ids_.push(id);
+            --count_;
+        }
+        finished_.clear();
+    }
+
+    size_t size() const { return count_; }
+
+    template <typename F> void for_each(F f) {
+        for (auto &s : slots_) if (s.used) f(s.job);
+    }
+
+private:
+    struct Slot {
+        Job job{};
+        uint32_t gen = 0;
+        bool used = false;
+    };
+    struct ProcRef {
+        int id;
+        size_t index;
+    };
+
+    std::deque<Slot> slots_;
+    std::priority_queue<int, std::vector<int>, std::greater<int>> free_ids_;
+    std::unordered_map<pid_t, int> by_pgid_;
+    std::unordered_map<pid_t, ProcRef> by_pid_;
+    std::vector<int> finished_;
+    size_t count_ = 0;
 };
 
-static std::deque<Job> jobs;
+static JobTable jobs;
+static int last_status = 0;          // exit code of the last foreground job
 static struct termios shell_tmodes;
 static pid_t shell_pgid = 0;
+static bool interactive = true;      // false for -c, script files and piped stdin
+
+// Options changed with the `set` builtin.
+static size_t opt_pipebuf = 0;       // F_SETPIPE_SZ for every pipe; 0 = kernel default
+static bool opt_debug = false;       // trace shell internals on stderr
+static bool opt_pipefail = false;    // a pipeline fails if any stage does
+// How background jobs that finish or stop are announced at the prompt
+// (see print_job_notice); notify=MODE[:MS].
+enum class NotifyMode : unsigned char { Immediate, Batch, Summary, Off };
+static NotifyMode opt_notify = NotifyMode::Batch;
+static int opt_notify_ms = 100;      // least time between two batches
 
 // ---------- Utilities ----------
 static inline void safe_perror(const char *msg) {
     std::cerr << msg << ": " << std::strerror(errno) << "\n";
 }
 
+// safe_perror() for a forked child on its way to exec. Another thread may
+// have held the iostream or malloc locks at fork time, so the message is
+// put together on the stack and goes out in one write().
+static void child_perror(const char *msg) {
+    int err = errno;
+    char buf[256];
+    size_t len = 0;
+    auto add = [&](const char *s) { while (*s && len < sizeof(buf) - 1) buf[len++] = *s++; };
+    add(msg);
+    add(": ");
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 32)
+    const char *text = strerrordesc_np(err);
+#else
+    const char *text = nullptr;
+#endif
+    if (text) {
+        add(text);
+    } else {
+        char num[16];
+        size_t n = 0;
+        for (unsigned v = static_cast<unsigned>(err); n == 0 || v; v /= 10) num[n++] = static_cast<char>('0' + v % 10);
+        add("error ");
+        while (n > 0 && len < sizeof(buf) - 1) buf[len++] = num[--n];
+    }
+    buf[len++] = '\n';
+    if (write(STDERR_FILENO, buf, len) < 0) { /* nowhere to report it */ }
+}
+
 std::string join_tokens(const std::vector<std::string> &v, const std::string &sep = " ") {
     std::string s;
     for (size_t i = 0; i < v.size(); ++i) {
@@ -48,439 +268,5427 @@ std::string join_tokens(const std::vector<std::string> &v, const std::string &se
     return s;
 }
 
-// ---------- Readline completion ----------
-char **custom_completion(const char *text, int start, int end) {
-    rl_attempted_completion_over = 0;
-    return rl_completion_matches(text, rl_filename_completion_function);
+// Sizes as `set pipebuf=` takes them: a byte count with an optional K, M or G.
+static bool parse_size(std::string_view text, size_t &out) {
+    size_t i = 0, n = 0;
+    while (i < text.size() && isdigit((unsigned char)text[i])) {
+        if (n > (SIZE_MAX >> 31)) return false;
+        n = n * 10 + (text[i++] - '0');
+    }
+    if (i == 0) return false;
+    if (i < text.size()) {
+        switch (text[i++]) {
+        case 'k': case 'K': n <<= 10; break;
+        case 'm': case 'M': n <<= 20; break;
+        case 'g': case 'G': n <<= 30; break;
+        default: return false;
+        }
+    }
+    if (i != text.size() || n == 0) return false;
+    out = n;
+    return true;
+}
+
+static bool is_name_start(char c) { return isalpha((unsigned char)c) || c == '_'; }
+static bool is_name_char(char c) { return isalnum((unsigned char)c) || c == '_'; }
+
+static bool valid_name(std::string_view n) {
+    if (n.empty() || !is_name_start(n[0])) return false;
+    for (char c : n) if (!is_name_char(c)) return false;
+    return true;
+}
+
+// Parses a kernel-style CPU list ("0-3,8,10-11") into `set`.
+static bool parse_cpulist(std::string_view text, cpu_set_t &set) {
+    CPU_ZERO(&set);
+    if (text.empty()) return false;
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t comma = text.find(',', pos);
+        if (comma == std::string_view::npos) comma = text.size();
+        std::string range(text.substr(pos, comma - pos));
+        char *end;
+        long lo = strtol(range.c_str(), &end, 10), hi = lo;
+        if (end == range.c_str()) return false;
+        if (*end == '-') {
+            const char *p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p) return false;
+        }
+        if (*end || lo < 0 || hi < lo || hi >= CPU_SETSIZE) return false;
+        for (long c = lo; c <= hi; ++c) CPU_SET(c, &set);
+        pos = comma + 1;
+    }
+    return true;
+}
+
+static std::string format_size(size_t n) {
+    if (n % (1u << 30) == 0) return std::to_string(n >> 30) + "G";
+    if (n % (1u << 20) == 0) return std::to_string(n >> 20) + "M";
+    if (n % (1u << 10) == 0) return std::to_string(n >> 10) + "K";
+    return std::to_string(n);
 }
 
 // ---------- Job management ----------
-void add_job(pid_t pgid, const std::string &cmdline, bool background) {
-    Job j;
-    j.id = next_job_id++;
-    j.pgid = pgid;
-    j.cmdline = cmdline;
-    j.running = true;
-    j.stopped = false;
-    j.background = background;
-    jobs.push_back(j);
-    if (background) {
+// `spawn_ns` is how long starting the processes took, for telemetry.
+Job &add_job(pid_t pgid, const std::vector<pid_t> &pids, const std::string &cmdline, bool background,
+             int64_t spawn_ns = 0) {
+    Job &j = jobs.add(pgid, pids, cmdline, background);
+    telemetry_job_started(j, spawn_ns);
+    // Only for the user at a prompt: scripts capture this output.
+    if (background && interactive) {
         std::cout << "[" << j.id << "] " << pgid << " started: " << cmdline << "\n";
     }
+    return j;
 }
 
 Job* find_job_by_id(int id) {
-    for (auto &j : jobs) if (j.id == id) return &j;
-    return nullptr;
+    return jobs.by_id(id);
 }
 
 Job* find_job_by_pgid(pid_t pgid) {
-    for (auto &j : jobs) if (j.pgid == pgid) return &j;
-    return nullptr;
+    return jobs.by_pgid(pgid);
+}
+
+Job* find_job_by_pid(pid_t pid, size_t *index = nullptr) {
+    return jobs.by_pid(pid, index);
 }
 
 void remove_finished_jobs() {
-    for (auto it = jobs.begin(); it != jobs.end(); ) {
-        if (!it->running && !it->stopped) it = jobs.erase(it);
-        else ++it;
+    jobs.remove_finished();
+}
+
+void mark_job_stopped(Job &j) {
+    j.stopped = true; j.running = false;
+}
+
+void mark_job_done(Job &j) {
+    if (!j.running && !j.stopped) return;
+    j.running = false; j.stopped = false;
+    for (auto &p : j.procs) {
+        if (p.pidfd >= 0) { close(p.pidfd); p.pidfd = -1; }
+    }
+    telemetry_job_done(j);
+    jobs.finished(j);
+}
+
+int exit_code(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 0;
+}
+
+bool parallel_item_exited(Job &j, size_t index);
+
+// Records a waitpid()-style status (and, on exit, the rusage wait4 returned)
+// for process `index` of `j`. The job is done once every process has exited
+// and stopped as soon as any one has stopped. Returns true if the job
+// changed state.
+bool update_process(Job &j, size_t index, int status, const struct rusage *ru = nullptr) {
+    if (index >= j.procs.size() || j.procs[index].done) return false;
+    Process *p = &j.procs[index];
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        p->done = true;
+        p->stopped = false;
+        p->status = status;
+        p->end_ns = now_ns();
+        if (ru) p->ru = *ru;
+        if (p->pidfd >= 0) { close(p->pidfd); p->pidfd = -1; }
+        j.live--;
+        // May start the next inputs, i.e. append to j.procs.
+        if (j.run && parallel_item_exited(j, index)) return false;
+        if (j.live > 0) return false;
+        mark_job_done(j);
+        return true;
+    }
+    if (WIFSTOPPED(status)) {
+        p->stopped = true;
+        if (j.stopped) return false;
+        mark_job_stopped(j);
+        return true;
+    }
+    if (WIFCONTINUED(status)) {
+        p->stopped = false;
+        if (j.running) return false;
+        j.running = true; j.stopped = false;
+        return true;
     }
+    return false;
 }
 
-void mark_job_stopped(pid_t pgid) {
-    Job* j = find_job_by_pgid(pgid);
-    if (j) { j->stopped = true; j->running = false; }
+// ---------- Timing ----------
+// `time pipeline` prints wall/user/sys for the whole job and a row per stage
+// from the rusage wait4() reports for each process, so the slow stage of
+// `a | b | c` stands out. `times` prints the shell's and its children's
+// cumulative user/sys like bash.
+static double tv_seconds(const struct timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
 }
 
-void mark_job_done(pid_t pgid) {
-    Job* j = find_job_by_pgid(pgid);
-    if (j) { j->running = false; j->stopped = false; }
+static std::string format_minsec(double secs) {
+    char buf[64];
+    int m = static_cast<int>(secs / 60);
+    snprintf(buf, sizeof(buf), "%dm%.3fs", m, secs - m * 60);
+    return buf;
 }
 
-// ---------- Signals ----------
-void sigchld_handler(int) {
-    int saved_errno = errno;
+static bool cgroup_stats(const std::string &path, uint64_t &user_us, uint64_t &sys_us, uint64_t &peak);
+
+void print_time_report(const Job &j) {
+    int64_t start = 0, end = 0;
+    double user = 0, sys = 0;
+    for (auto &p : j.procs) {
+        if (!start || p.start_ns < start) start = p.start_ns;
+        end = std::max(end, p.end_ns);
+        user += tv_seconds(p.ru.ru_utime);
+        sys += tv_seconds(p.ru.ru_stime);
+    }
+    double wall = (end - start) / 1e9;
+    char row[256];
+    // A `limit` job's cgroup also counts what its stages left running or
+    // didn't wait for, which wait4's rusage can't see.
+    uint64_t cg_user = 0, cg_sys = 0, cg_peak = 0;
+    bool from_cgroup = !j.cgroup.empty() && cgroup_stats(j.cgroup, cg_user, cg_sys, cg_peak);
+    if (from_cgroup) {
+        user = cg_user / 1e6;
+        sys = cg_sys / 1e6;
+    }
+    std::cerr << "\nreal\t" << format_minsec(wall) << "\nuser\t" << format_minsec(user)
+              << "\nsys\t" << format_minsec(sys) << "\n";
+    if (from_cgroup) {
+        std::cerr << "cgroup\t" << j.cgroup << "\n";
+        if (cg_peak) std::cerr << "peak\t" << cg_peak / 1024 << " KB\n";
+    }
+    std::cerr << "stage      pid     real     user      sys   maxrss(KB)   vcsw  ivcsw  minflt  majflt  status\n";
+    for (size_t k = 0; k < j.procs.size(); ++k) {
+        const Process &p = j.procs[k];
+        snprintf(row, sizeof(row), "%5zu %8d %7.3fs %7.3fs %7.3fs %12ld %6ld %6ld %7ld %7ld  %6d\n",
+                 k + 1, static_cast<int>(p.pid), (p.end_ns - p.start_ns) / 1e9,
+                 tv_seconds(p.ru.ru_utime), tv_seconds(p.ru.ru_stime), p.ru.ru_maxrss,
+                 p.ru.ru_nvcsw, p.ru.ru_nivcsw, p.ru.ru_minflt, p.ru.ru_majflt, exit_code(p.status));
+        std::cerr << row;
+    }
+}
+
+// For builtins, which run inside the shell: wall time plus the shell's own
+// rusage delta.
+void print_builtin_time(int64_t start_ns, const struct rusage &before) {
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    std::cerr << "\nreal\t" << format_minsec((now_ns() - start_ns) / 1e9)
+              << "\nuser\t" << format_minsec(tv_seconds(after.ru_utime) - tv_seconds(before.ru_utime))
+              << "\nsys\t" << format_minsec(tv_seconds(after.ru_stime) - tv_seconds(before.ru_stime)) << "\n";
+}
+
+void builtin_times() {
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    std::cout << format_minsec(tv_seconds(self.ru_utime)) << " " << format_minsec(tv_seconds(self.ru_stime)) << "\n"
+              << format_minsec(tv_seconds(children.ru_utime)) << " " << format_minsec(tv_seconds(children.ru_stime)) << "\n";
+}
+
+// ---------- Telemetry ----------
+// With `set telemetry=FILE` (or unix:SOCKET, or $SHELL_TELEMETRY at start)
+// every job sends a JSON line when it starts and another when it has
+// finished. The shell only formats the record and copies it into a ring
+// buffer. A flusher thread drains the ring to the file or socket, so
+// a slow disk or collector never holds the prompt up. When the ring is
+// full, records are dropped and the count is reported in the next one.
+struct TelemetrySink {
+    static constexpr size_t ring_size = 1 << 16;
+    char ring[ring_size];
+    std::atomic<size_t> head{0};        // bytes ever queued; written by the shell
+    std::atomic<size_t> tail{0};        // bytes ever flushed; written by the flusher
+    std::atomic<bool> sleeping{false};  // flusher is blocked on wake_fd
+    std::atomic<bool> stop{false};
+    int wake_fd = -1;
+    int out_fd = -1;
+    pid_t owner = 0;                    // forked children must not touch the thread
+    uint64_t dropped = 0;
+    std::string target;
+    std::string record;                 // reused formatting buffer
+    std::thread flusher;
+};
+static TelemetrySink *telemetry = nullptr;
+
+static int64_t wall_clock_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void telemetry_flusher(TelemetrySink *t) {
     while (true) {
-        int status;
-        pid_t pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED);
-        if (pid <= 0) break;
-        pid_t pgid = getpgid(pid);
-        if (pgid < 0) continue;
-        if (WIFEXITED(status) || WIFSIGNALED(status)) {
-            mark_job_done(pgid);
-            Job* j = find_job_by_pgid(pgid);
-            if (j && j->background) {
-                std::cout << "\n[" << j->id << "] Done\t" << j->cmdline << "\n";
-                rl_on_new_line(); rl_replace_line("", 0); rl_redisplay();
-            }
-        } else if (WIFSTOPPED(status)) {
-            mark_job_stopped(pgid);
-            Job* j = find_job_by_pgid(pgid);
-            if (j) {
-                std::cout << "\n[" << j->id << "] Stopped\t" << j->cmdline << "\n";
-                rl_on_new_line(); rl_replace_line("", 0); rl_redisplay();
-            }
-        } else if (WIFCONTINUED(status)) {
-            Job* j = find_job_by_pgid(pgid);
-            if (j) { j->running = true; j->stopped = false; }
+        size_t from = t->tail.load(std::memory_order_relaxed);
+        size_t to = t->head.load();
+        if (from == to) {
+            if (t->stop.load()) return;
+            // Announce the sleep, then look again: a record queued in between
+            // either shows up here or sees `sleeping` and writes wake_fd.
+            t->sleeping.store(true);
+            if (t->head.load() == from && !t->stop.load()) {
+                uint64_t n;
+                if (read(t->wake_fd, &n, sizeof(n)) < 0 && errno != EINTR) return;
+            }
+            t->sleeping.store(false);
+            continue;
         }
+        while (from != to) {
+            size_t at = from % TelemetrySink::ring_size;
+            size_t len = std::min(to - from, TelemetrySink::ring_size - at);
+            ssize_t w = write(t->out_fd, t->ring + at, len);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) break;              // lost sink: drop what is queued
+            from += w;
+        }
+        t->tail.store(to, std::memory_order_release);
     }
-    errno = saved_errno;
 }
 
-void handle_sigint_shell(int) {
-    std::cout << "\n";
-    rl_on_new_line(); rl_replace_line("", 0); rl_redisplay();
+static void telemetry_push(TelemetrySink &t, const std::string &rec) {
+    // A forked copy of the shell (a subshell, $(...)) has no flusher: it
+    // writes each record itself, whole, so appends don't interleave.
+    if (t.owner != getpid()) {
+        for (size_t off = 0; off < rec.size(); ) {
+            ssize_t w = write(t.out_fd, rec.data() + off, rec.size() - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) { t.dropped++; return; }
+            off += w;
+        }
+        return;
+    }
+    size_t head = t.head.load(std::memory_order_relaxed);
+    size_t tail = t.tail.load(std::memory_order_acquire);
+    if (TelemetrySink::ring_size - (head - tail) < rec.size()) { t.dropped++; return; }
+    size_t at = head % TelemetrySink::ring_size;
+    size_t first = std::min(rec.size(), TelemetrySink::ring_size - at);
+    memcpy(t.ring + at, rec.data(), first);
+    memcpy(t.ring, rec.data() + first, rec.size() - first);
+    t.head.store(head + rec.size());
+    if (t.sleeping.exchange(false)) {
+        uint64_t one = 1;
+        if (write(t.wake_fd, &one, sizeof(one)) < 0) { /* already pending */ }
+    }
 }
 
-// ---------- Parsing helpers ----------
-std::vector<std::string> split_pipe_segments(const std::string &line) {
-    std::vector<std::string> segments;
-    std::string cur;
-    bool in_quote = false;
-    char quote_char = 0;
-    for (size_t i = 0; i < line.size(); ++i) {
-        char c = line[i];
-        if (!in_quote && (c == '\'' || c == '"')) {
-            in_quote = true; quote_char = c; cur.push_back(c);
-        } else if (in_quote && c == quote_char) {
-            in_quote = false; cur.push_back(c);
-        } else if (!in_quote && c == '|') {
-            segments.push_back(cur);
-            cur.clear();
-        } else {
-            cur.push_back(c);
+// Flushes what is queued and stops the flusher.
+static void telemetry_close() {
+    if (!telemetry || telemetry->owner != getpid()) return;
+    telemetry->stop.store(true);
+    uint64_t one = 1;
+    if (write(telemetry->wake_fd, &one, sizeof(one)) < 0) { /* already pending */ }
+    telemetry->flusher.join();
+    close(telemetry->wake_fd);
+    close(telemetry->out_fd);
+    delete telemetry;
+    telemetry = nullptr;
+}
+
+// `target` is a file to append to or unix:PATH for a stream socket.
+static bool telemetry_open(const std::string &target) {
+    int fd;
+    if (target.compare(0, 5, "unix:") == 0) {
+        struct sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (target.size() - 5 >= sizeof(addr.sun_path)) {
+            std::cerr << "telemetry: socket path too long\n";
+            return false;
         }
+        memcpy(addr.sun_path, target.c_str() + 5, target.size() - 5);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        fd = open(target.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
     }
-    if (!cur.empty()) segments.push_back(cur);
-    for (auto &s : segments) {
-        size_t a = s.find_first_not_of(" \t");
-        size_t b = s.find_last_not_of(" \t");
-        s = (a == std::string::npos) ? "" : s.substr(a, b - a + 1);
+    if (fd < 0) {
+        std::cerr << "telemetry: " << target << ": " << std::strerror(errno) << "\n";
+        return false;
     }
-    return segments;
+    telemetry_close();
+    telemetry = new TelemetrySink;
+    telemetry->out_fd = fd;
+    telemetry->wake_fd = eventfd(0, EFD_CLOEXEC);
+    telemetry->owner = getpid();
+    telemetry->target = target;
+    // The flusher must never take SIGCHLD or SIGINT meant for the signalfd.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    telemetry->flusher = std::thread(telemetry_flusher, telemetry);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    static bool registered = false;
+    if (!registered) { atexit(telemetry_close); registered = true; }
+    return true;
 }
 
-std::vector<std::string> tokenize_space(const std::string &s) {
-    std::vector<std::string> tokens;
-    std::string cur;
-    bool in_quote = false;
-    char qch = 0;
-    for (size_t i = 0; i < s.size(); ++i) {
-        char c = s[i];
-        if (!in_quote && (c == '"' || c == '\'')) {
-            in_quote = true; qch = c; cur.push_back(c);
-        } else if (in_quote && c == qch) {
-            in_quote = false; cur.push_back(c);
-        } else if (!in_quote && isspace((unsigned char)c)) {
-            if (!cur.empty()) { tokens.push_back(cur); cur.clear(); }
-        } else {
-            cur.push_back(c);
-        }
+static void json_string(std::string &out, std::string_view s) {
+    out += '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') { out += '\\'; out += c; }
+        else if (c == '\n') out += "\\n";
+        else if (c == '\t') out += "\\t";
+        else if (c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else out += c;
     }
-    if (!cur.empty()) tokens.push_back(cur);
-    return tokens;
+    out += '"';
 }
 
-struct Command {
-    std::vector<char*> argv;
-    std::string infile;
-    std::string outfile;
-    bool append = false;
-};
+static void telemetry_begin(TelemetrySink &t, const char *event, const Job &j) {
+    std::string &r = t.record;
+    r.clear();
+    r += "{\"ts\":" + std::to_string(wall_clock_us()) + ",\"event\":\"" + event + "\",\"job\":" +
+         std::to_string(j.id) + ",\"pgid\":" + std::to_string(j.pgid) + ",\"cmd\":";
+    json_string(r, j.cmdline);
+    if (t.dropped) {
+        r += ",\"dropped\":" + std::to_string(t.dropped);
+        t.dropped = 0;
+    }
+}
 
-Command parse_command_segment(const std::string &seg) {
-    Command cmd;
-    auto toks = tokenize_space(seg);
-    for (size_t i = 0; i < toks.size();) {
-        std::string t = toks[i];
-        if (t == "<") {
-            if (i + 1 < toks.size()) cmd.infile = toks[i + 1];
-            i += 2;
-        } else if (t == ">" || t == ">>") {
-            if (t == ">>") cmd.append = true;
-            if (i + 1 < toks.size()) cmd.outfile = toks[i + 1];
-            i += 2;
-        } else {
-            std::string clean = t;
-            if (clean.size() >= 2 && ((clean.front() == '"' && clean.back() == '"') ||
-                (clean.front() == '\'' && clean.back() == '\''))) {
-                clean = clean.substr(1, clean.size() - 2);
+static void telemetry_job_started(const Job &j, int64_t spawn_ns) {
+    if (!telemetry) return;
+    telemetry_begin(*telemetry, "start", j);
+    std::string &r = telemetry->record;
+    r += ",\"background\":";
+    r += j.background ? "true" : "false";
+    r += ",\"spawn_us\":" + std::to_string(spawn_ns / 1000) + ",\"pids\":[";
+    for (size_t k = 0; k < j.procs.size(); ++k) r += (k ? "," : "") + std::to_string(j.procs[k].pid);
+    r += "]}\n";
+    telemetry_push(*telemetry, r);
+}
+
+static int64_t tv_us(const struct timeval &tv) {
+    return static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+// Job totals plus a row per process, from the rusage each one was reaped with.
+static void telemetry_job_done(const Job &j) {
+    if (!telemetry) return;
+    telemetry_begin(*telemetry, "exit", j);
+    std::string &r = telemetry->record;
+    int64_t start = 0, end = 0, user = 0, sys = 0;
+    long maxrss = 0;
+    std::string stages;
+    for (size_t k = 0; k < j.procs.size(); ++k) {
+        const Process &p = j.procs[k];
+        if (!start || p.start_ns < start) start = p.start_ns;
+        end = std::max(end, p.end_ns);
+        user += tv_us(p.ru.ru_utime);
+        sys += tv_us(p.ru.ru_stime);
+        maxrss = std::max(maxrss, p.ru.ru_maxrss);
+        stages += std::string(k ? "," : "") + "{\"pid\":" + std::to_string(p.pid) +
+                  ",\"status\":" + std::to_string(exit_code(p.status)) +
+                  ",\"wall_us\":" + std::to_string((p.end_ns - p.start_ns) / 1000) +
+                  ",\"user_us\":" + std::to_string(tv_us(p.ru.ru_utime)) +
+                  ",\"sys_us\":" + std::to_string(tv_us(p.ru.ru_stime)) +
+                  ",\"maxrss_kb\":" + std::to_string(p.ru.ru_maxrss) + "}";
+    }
+    int status = j.procs.empty() ? 0 : exit_code(j.procs.back().status);
+    r += ",\"status\":" + std::to_string(status) + ",\"wall_us\":" + std::to_string((end - start) / 1000) +
+         ",\"user_us\":" + std::to_string(user) + ",\"sys_us\":" + std::to_string(sys) +
+         ",\"maxrss_kb\":" + std::to_string(maxrss) + ",\"stages\":[" + stages + "]}\n";
+    telemetry_push(*telemetry, r);
+}
+
+// Processes of $(...) and <(...) aren't jobs. They wait here, with job id
+// 0, between their start record and their exit record.
+static std::vector<Job> telemetry_strays;
+
+static void telemetry_stray_started(const std::string &cmdline, pid_t pgid, const std::vector<pid_t> &pids,
+                                    int64_t spawn_ns) {
+    if (!telemetry || pids.empty()) return;
+    Job j{};
+    j.pgid = pgid;
+    j.cmdline = cmdline;
+    j.running = true;
+    for (pid_t pid : pids) {
+        Process p{};
+        p.pid = pid;
+        p.start_ns = now_ns();
+        j.procs.push_back(p);
+    }
+    j.live = j.procs.size();
+    telemetry_job_started(j, spawn_ns);
+    telemetry_strays.push_back(std::move(j));
+}
+
+static void telemetry_stray_reaped(pid_t pid, int status, const struct rusage &ru) {
+    if (!WIFEXITED(status) && !WIFSIGNALED(status)) return;
+    for (auto j = telemetry_strays.begin(); j != telemetry_strays.end(); ++j) {
+        for (Process &p : j->procs) {
+            if (p.pid != pid || p.done) continue;
+            p.done = true;
+            p.status = status;
+            p.end_ns = now_ns();
+            p.ru = ru;
+            if (--j->live == 0) {
+                telemetry_job_done(*j);
+                telemetry_strays.erase(j);
             }
-            cmd.argv.push_back(strdup(clean.c_str()));
-            i++;
+            return;
         }
     }
-    cmd.argv.push_back(nullptr);
-    return cmd;
 }
 
-void free_command_args(Command &c) {
-    for (auto p : c.argv) if (p) free(p);
-    c.argv.clear();
-    c.argv.push_back(nullptr);
+// ---------- Signals ----------
+// Nothing runs in signal context. SIGCHLD (and SIGINT when interactive) are
+// blocked and read from a signalfd that the main loop polls next to readline's
+// input. Where signalfd is unavailable, a handler writes the signal number to
+// a self-pipe instead; all it does is one write().
+static int signal_fd = -1;
+static int signal_pipe[2] = {-1, -1};
+
+static void signal_to_pipe(int sig) {
+    int saved_errno = errno;
+    unsigned char b = static_cast<unsigned char>(sig);
+    ssize_t r = write(signal_pipe[1], &b, 1);
+    (void)r;
+    errno = saved_errno;
+}
+
+void setup_signal_events(bool with_sigint) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (with_sigint) sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd >= 0) return;
+
+    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+    if (pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) < 0) { safe_perror("pipe"); return; }
+    struct sigaction sa;
+    sa.sa_handler = signal_to_pipe;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, nullptr);
+    if (with_sigint) sigaction(SIGINT, &sa, nullptr);
 }
 
-// ---------- Builtins ----------
-bool is_builtin_name(const std::string &s) {
-    return (s == "cd" || s == "help" || s == "exit" || s == "clear" ||
-            s == "about" || s == "jobs" || s == "fg" || s == "bg" || s == "killjob");
+int signal_event_fd() {
+    return signal_fd >= 0 ? signal_fd : signal_pipe[0];
 }
 
-void print_jobs() {
-    for (auto &j : jobs) {
-        std::cout << "[" << j.id << "] " <<
-            (j.running ? "Running" : (j.stopped ? "Stopped" : "Done")) <<
-            "\t" << j.pgid << "\t" << j.cmdline << (j.background ? " &" : "") << "\n";
+// Drains pending signal events; reports which signals were seen.
+void drain_signal_events(bool &got_chld, bool &got_int) {
+    got_chld = got_int = false;
+    if (signal_fd >= 0) {
+        struct signalfd_siginfo si[16];
+        ssize_t r;
+        while ((r = read(signal_fd, si, sizeof(si))) > 0) {
+            for (size_t k = 0; k < static_cast<size_t>(r) / sizeof(si[0]); ++k) {
+                if (si[k].ssi_signo == SIGCHLD) got_chld = true;
+                else if (si[k].ssi_signo == SIGINT) got_int = true;
+            }
+        }
+    } else if (signal_pipe[0] >= 0) {
+        unsigned char b[64];
+        ssize_t r;
+        while ((r = read(signal_pipe[0], b, sizeof(b))) > 0) {
+            for (ssize_t k = 0; k < r; ++k) {
+                if (b[k] == SIGCHLD) got_chld = true;
+                else if (b[k] == SIGINT) got_int = true;
+            }
+        }
     }
 }
 
-void show_easter_egg(const std::string &cmd) {
-    if (cmd == "rhino") {
-        std::cout << "\n\033[1;31mTHUG\033[0m\n";
-        std::cout << "\033[1;36m\"He who makes others see but he himself is invisible.\"\033[0m\n\n";
-    } else if (cmd == "xsmax") {
-        std::cout << "\n\033[1;33mR€$!$T\033[0m\n";
-        std::cout << "\033[1;35m\"Can't see his own Abyss.\"\033[0m\n\n";
+// Job notices are printed at the prompt, which is then redrawn with whatever
+// the user had typed so far. While a foreground job owns the terminal they
+// are held back until the next prompt. Unless notify=immediate they are
+// collected and shown together opt_notify_ms after the first of them, so
+// a burst of jobs ending costs one batch and one redraw however many there
+// are; notify=summary shows a batch as a single count line.
+static bool at_prompt = false;
+static bool at_main_prompt = false;    // at_prompt, and not a "> " continuation
+static std::vector<std::string> held_notices;
+static size_t held_done = 0, held_failed = 0, held_stopped = 0;   // notify=summary
+static int64_t notices_since_ns = 0;   // when the oldest held notice came in
+
+#ifdef SHELL_NO_READLINE
+// The terminal is read in cooked mode, so the kernel does the line editing
+// and a redraw can only put the prompt back; what was typed stays queued.
+static std::string input_prompt;
+static void redraw_input_line() {
+    // The \001..\002 markers are only for readline's column count.
+    for (char c : input_prompt) if (c != '\001' && c != '\002') std::cout << c;
+    std::cout << std::flush;
+}
+#else
+static void redraw_input_line() {
+    rl_on_new_line();
+    rl_redisplay();
+}
+#endif
+
+static bool notices_pending() {
+    return !held_notices.empty() || held_done || held_stopped;
+}
+
+static void write_held_notices() {
+    for (auto &n : held_notices) std::cout << n << "\n";
+    held_notices.clear();
+    if (held_done || held_stopped) {
+        size_t jobs = held_done + held_stopped;
+        std::cout << jobs << (jobs == 1 ? " job " : " jobs ");
+        if (held_done) std::cout << "done";
+        if (held_failed) std::cout << ", " << held_failed << " failed";
+        if (held_stopped) std::cout << (held_done ? ", " : "") << held_stopped << " stopped";
+        std::cout << "\n";
     }
+    held_done = held_failed = held_stopped = 0;
 }
 
-void builtin_execute(const std::vector<std::string> &words) {
-    if (words.empty()) return;
-    const std::string &cmd = words[0];
-    if (cmd == "cd") {
-        if (words.size() >= 2) {
-            if (chdir(words[1].c_str()) != 0) perror("cd");
-        } else {
-            const char *home = getenv("HOME");
-            if (home) chdir(home);
-        }
-    } else if (cmd == "help") {
-        std::cout << "mini-shell help:\nBuiltins: cd, help, clear, about, jobs, fg, bg, killjob, exit\n";
-    } else if (cmd == "clear") {
-        std::cout << "\033[H\033[2J" << std::flush;
-    } else if (cmd == "about") {
-        std::cout << "Ultimate mini-shell by Sami-style assistant.\n";
-    } else if (cmd == "jobs") {
-        print_jobs();
-    } else if (cmd == "fg") {
-        if (words.size() >= 2) {
-            std::string idstr = words[1];
-            if (!idstr.empty() && idstr[0] == '%') idstr = idstr.substr(1);
-            int id = atoi(idstr.c_str());
-            Job* j = find_job_by_id(id);
-            if (!j) { std::cout << "fg: job not found\n"; return; }
-            if (kill(-j->pgid, SIGCONT) < 0) perror("SIGCONT");
-            j->background = false; j->stopped = false; j->running = true;
-            tcsetpgrp(STDIN_FILENO, j->pgid);
-            int status;
-            waitpid(-j->pgid, &status, WUNTRACED);
-            tcsetpgrp(STDIN_FILENO, shell_pgid);
-            if (WIFSTOPPED(status)) { j->stopped = true; j->running = false; }
-            else { j->running = false; j->stopped = false; }
-            remove_finished_jobs();
-        } else std::cout << "fg: usage: fg %jobid\n";
-    } else if (cmd == "bg") {
-        if (words.size() >= 2) {
-            std::string idstr = words[1];
-            if (!idstr.empty() && idstr[0] == '%') idstr = idstr.substr(1);
-            int id = atoi(idstr.c_str());
-            Job* j = find_job_by_id(id);
-            if (!j) { std::cout << "bg: job not found\n"; return; }
-            if (kill(-j->pgid, SIGCONT) < 0) perror("SIGCONT");
-            j->background = true; j->stopped = false; j->running = true;
-            std::cout << "[" << j->id << "] " << j->pgid << " resumed in background\n";
-        } else std::cout << "bg: usage: bg %jobid\n";
-    } else if (cmd == "killjob") {
-        if (words.size() >= 2) {
-            std::string idstr = words[1];
-            if (!idstr.empty() && idstr[0] == '%') idstr = idstr.substr(1);
-            int id = atoi(idstr.c_str());
-            Job* j = find_job_by_id(id);
-            if (!j) { std::cout << "killjob: job not found\n"; return; }
-            if (kill(-j->pgid, SIGKILL) < 0) perror("kill");
-            else std::cout << "killed job " << j->id << "\n";
-        } else std::cout << "killjob: usage: killjob %jobid\n";
-    } else if (cmd == "exit") exit(0);
-    else if (cmd == "rhino" || cmd == "xsmax") show_easter_egg(cmd);
+static void prompt_redraw();
+
+// Shows what was collected above the prompt and redraws it. The main
+// prompt is rebuilt, since its job count has likely changed.
+static void show_held_notices() {
+    if (!notices_pending()) return;
+    std::cout << "\n";
+    write_held_notices();
+    std::cout.flush();
+    if (at_main_prompt) prompt_redraw();
+    else redraw_input_line();
 }
 
-// ---------- Execution ----------
-void launch_pipeline(std::vector<Command> &commands, bool background, const std::string &cmdline) {
-    size_t n = commands.size();
-    std::vector<int> pipes;
-    pipes.resize((n > 0 ? n - 1 : 0) * 2);
+// How long the prompt may wait before the next batch is due: -1 for as
+// long as it likes, 0 if it is due now.
+static int notices_wait_ms() {
+    if (!notices_pending()) return -1;
+    int64_t left = notices_since_ns + int64_t(opt_notify_ms) * 1000000 - now_ns();
+    return left <= 0 ? 0 : static_cast<int>((left + 999999) / 1000000);
+}
 
-    for (size_t i = 0; i + 1 < n; ++i) {
-        if (pipe(&pipes[i*2]) < 0) { perror("pipe"); return; }
+static void print_job_notice(const Job &j, const char *state) {
+    if (!interactive || opt_notify == NotifyMode::Off) return;
+    if (!notices_pending()) notices_since_ns = now_ns();
+    if (opt_notify == NotifyMode::Summary) {
+        bool stopped = strcmp(state, "Stopped") == 0;
+        (stopped ? held_stopped : held_done)++;
+        if (!stopped && !j.procs.empty() && exit_code(j.procs.back().status) != 0) held_failed++;
+    } else {
+        held_notices.push_back("[" + std::to_string(j.id) + "] " + state + "\t" + j.cmdline);
     }
+    // Otherwise the prompt loop shows them once the whole burst is reaped.
+    if (at_prompt && opt_notify == NotifyMode::Immediate) show_held_notices();
+}
 
-    pid_t pgid = 0;
-    for (size_t i = 0; i < n; ++i) {
-        pid_t pid = fork();
-        if (pid < 0) { safe_perror("fork"); return; }
-        else if (pid == 0) {
-            if (i == 0) setpgid(0, 0); else setpgid(0, pgid);
-            signal(SIGINT, SIG_DFL); signal(SIGQUIT, SIG_DFL); signal(SIGTSTP, SIG_DFL);
-
-            if (i > 0) dup2(pipes[(i-1)*2], STDIN_FILENO);
-            if (i + 1 < n) dup2(pipes[i*2 + 1], STDOUT_FILENO);
-            for (size_t j = 0; j < pipes.size(); ++j) close(pipes[j]);
-
-            if (!commands[i].infile.empty()) {
-                int fd = open(commands[i].infile.c_str(), O_RDONLY);
-                if (fd < 0) { safe_perror("open infile"); exit(EXIT_FAILURE); }
-                dup2(fd, STDIN_FILENO); close(fd);
-            }
-            if (!commands[i].outfile.empty()) {
-                int flags = O_WRONLY | O_CREAT | (commands[i].append ? O_APPEND : O_TRUNC);
-                int fd = open(commands[i].outfile.c_str(), flags, 0644);
-                if (fd < 0) { safe_perror("open outfile"); exit(EXIT_FAILURE); }
-                dup2(fd, STDOUT_FILENO); close(fd);
-            }
-
-            execvp(commands[i].argv[0], commands[i].argv.data());
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        } else {
-            if (i == 0) { pgid = pid; setpgid(pid, pgid); }
-            else setpgid(pid, pgid);
-        }
-    }
+// A foreground job was stopped (^Z): said right away and whatever notify
+// is set to, since the user is waiting for the prompt to come back.
+static void print_stopped_job(const Job &j) {
+    if (interactive) std::cout << "\n[" << j.id << "] Stopped\t" << j.cmdline << std::endl;
+}
 
-    for (size_t j = 0; j < pipes.size(); ++j) close(pipes[j]);
+// Before a fresh prompt: no redraw needed.
+void flush_held_notices() {
+    if (!notices_pending()) return;
+    write_held_notices();
+    std::cout.flush();
+}
 
-    if (!background) {
-        tcsetpgrp(STDIN_FILENO, pgid);
+void reap_children() {
+    while (true) {
         int status;
-        pid_t w;
-        do {
-            w = waitpid(-pgid, &status, WUNTRACED);
-            if (w == -1) break;
-            if (WIFSTOPPED(status)) {
-                add_job(pgid, cmdline, false);
-                mark_job_stopped(pgid);
-                break;
-            }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-        tcsetpgrp(STDIN_FILENO, shell_pgid);
-    } else {
-        add_job(pgid, cmdline, true);
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru);
+        if (pid <= 0) break;
+        size_t index;
+        Job* j = find_job_by_pid(pid, &index);
+        if (!j) {
+            telemetry_stray_reaped(pid, status, ru);
+            continue;
+        }
+        if (!update_process(*j, index, status, &ru)) continue;
+        if (!j->running && !j->stopped) {
+            if (j->timed) print_time_report(*j);
+            if (j->background) print_job_notice(*j, "Done");
+        } else if (j->stopped) {
+            print_job_notice(*j, "Stopped");
+        }
     }
-    remove_finished_jobs();
 }
 
-// ---------- Main loop ----------
-int main() {
-    shell_pgid = getpid();
-    if (setpgid(shell_pgid, shell_pgid) < 0) { /* ignore */ }
-    tcsetpgrp(STDIN_FILENO, shell_pgid);
-    tcgetattr(STDIN_FILENO, &shell_tmodes);
+// ---------- Waiting ----------
+// The foreground job is waited on through pidfds: poll() wakes for exactly
+// the processes it owns, and waitid(P_PIDFD) collects each one without
+// touching anyone else's children. pidfds don't report stops, so the signal
+// fd is polled alongside for Ctrl-Z. That path, like kernels without
+// pidfd_open(), checks the job's own pids with waitpid(WNOHANG).
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
 
-    struct sigaction sa_chld;
-    sa_chld.sa_handler = sigchld_handler;
-    sigemptyset(&sa_chld.sa_mask);
-    sa_chld.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    sigaction(SIGCHLD, &sa_chld, nullptr);
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
 
-    struct sigaction sa_int;
-    sa_int.sa_handler = handle_sigint_shell;
-    sigemptyset(&sa_int.sa_mask);
-    sa_int.sa_flags = SA_RESTART;
-    sigaction(SIGINT, &sa_int, nullptr);
+static int status_from_siginfo(const siginfo_t &info) {
+    switch (info.si_code) {
+    case CLD_EXITED: return (info.si_status & 0xff) << 8;
+    case CLD_KILLED: return info.si_status & 0x7f;
+    case CLD_DUMPED: return (info.si_status & 0x7f) | 0x80;
+    case CLD_STOPPED:
+    case CLD_TRAPPED: return ((info.si_status & 0xff) << 8) | 0x7f;
+    default: return 0xffff;   // CLD_CONTINUED
+    }
+}
 
-    signal(SIGTTOU, SIG_IGN);
-    signal(SIGTTIN, SIG_IGN);
+static void poll_job_pids(Job &j) {
+    for (size_t k = 0; k < j.procs.size() && (j.running && !j.stopped); ++k) {
+        if (j.procs[k].done) continue;
+        int status;
+        struct rusage ru;
+        pid_t pid = j.procs[k].pid;
+        if (wait4(pid, &status, WNOHANG | WUNTRACED, &ru) == pid) update_process(j, k, status, &ru);
+    }
+}
 
-    rl_attempted_completion_function = custom_completion;
+// Waits until every process in `j` has exited or the job has stopped. With
+// `interruptible`, a ^C delivered to the shell itself (the job isn't in the
+// terminal's foreground) also ends the wait; returns false in that case.
+bool wait_for_job(Job &j, bool interruptible = false) {
+    bool interrupted = false;
+    JobHandle h = jobs.handle(j);
+    bool use_pidfds = true;
+    for (auto &p : j.procs) {
+        if (p.done || p.pidfd >= 0) continue;
+        p.pidfd = open_pidfd(p.pid);
+        if (p.pidfd < 0 && errno != ESRCH) use_pidfds = false;
+    }
 
-    while (true) {
-        char cwd[1024]; getcwd(cwd, sizeof(cwd));
-        std::string user = getenv("USER") ? getenv("USER") : "user";
-        std::string prompt = "\033[1;36m[" + user + "@ultimate-shell " + cwd + "]\033[0m$ ";
-        char *line_c = readline(prompt.c_str());
-        if (!line_c) { std::cout << "\n"; break; }
-        std::string line(line_c);
-        free(line_c);
-
-        auto start = line.find_first_not_of(" \t");
-        if (start == std::string::npos) continue;
-        auto end = line.find_last_not_of(" \t");
-        line = line.substr(start, end - start + 1);
-        if (line.empty()) continue;
-
-        add_history(line.c_str());
-        auto segments = split_pipe_segments(line);
-        if (segments.empty()) continue;
-
-        bool background = false;
-        if (!line.empty() && line.back() == '&') {
-            background = true;
-            // remove trailing &
-            while (!line.empty() && isspace((unsigned char)line.back())) line.pop_back();
-            if (!line.empty() && line.back() == '&') { line.pop_back(); }
-            // rebuild segments
-            segments = split_pipe_segments(line);
-        }
-
-        if (segments.size() == 1) {
-            auto toks = tokenize_space(segments[0]);
-            if (toks.empty()) continue;
-            if ((toks[0] == "rhino") || (toks[0] == "xsmax")) {
-                show_easter_egg(toks[0]);
-                continue;
-            }
-            if (is_builtin_name(toks[0])) {
-                std::vector<std::string> words;
-                for (auto &t : toks) words.push_back(t);
-                builtin_execute(words);
-                continue;
-            }
+    std::vector<struct pollfd> fds;
+    std::vector<size_t> owner;
+    while (jobs.get(h) && j.running && !j.stopped) {
+        fds.clear();
+        owner.clear();
+        for (size_t k = 0; k < j.procs.size(); ++k) {
+            if (j.procs[k].done || j.procs[k].pidfd < 0) continue;
+            fds.push_back({j.procs[k].pidfd, POLLIN, 0});
+            owner.push_back(k);
         }
+        fds.push_back({signal_event_fd(), POLLIN, 0});
+        // Without pidfds there is nothing to wake us for exits of processes
+        // that lack one, so fall back to a short timeout.
+        int timeout = use_pidfds ? -1 : 50;
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) { safe_perror("poll"); break; }
 
-        std::vector<Command> commands;
-        bool parse_failed = false;
-        for (auto &seg : segments) {
-            Command c = parse_command_segment(seg);
-            if (!c.argv.size() || c.argv[0] == nullptr) { parse_failed = true; free_command_args(c); break; }
-            commands.push_back(c);
+        for (size_t k = 0; k < owner.size(); ++k) {
+            if (!(fds[k].revents & POLLIN)) continue;
+            Process &p = j.procs[owner[k]];
+            siginfo_t info;
+            struct rusage ru;
+            info.si_pid = 0;
+            // The raw syscall takes a rusage argument; glibc's waitid() doesn't.
+            if (syscall(SYS_waitid, P_PIDFD, p.pidfd, &info, WEXITED | WNOHANG, &ru) == 0 && info.si_pid != 0)
+                update_process(j, owner[k], status_from_siginfo(info), &ru);
+            else if (errno == ECHILD || errno == EINVAL)
+                poll_job_pids(j);     // collected elsewhere, or no P_PIDFD support
         }
-        if (parse_failed) { std::cerr << "Parse error\n"; for (auto &c : commands) free_command_args(c); continue; }
+        if (!use_pidfds || (fds.back().revents & POLLIN)) {
+            bool got_chld, got_int;
+            drain_signal_events(got_chld, got_int);
+            poll_job_pids(j);
+            // Everyone else's children are still ours to reap.
+            if (got_chld) reap_children();
+            if (got_int && interruptible) { interrupted = true; break; }
+        }
+    }
+    for (auto &p : j.procs) {
+        if (p.pidfd >= 0) { close(p.pidfd); p.pidfd = -1; }
+    }
+    return !interrupted;
+}
 
-        // Special-case: single command is builtin with redirection
-        if (commands.size() == 1) {
-            std::string cmdname = commands[0].argv[0] ? commands[0].argv[0] : "";
-            if (is_builtin_name(cmdname)) {
-                int saved_stdin = -1, saved_stdout = -1;
-                bool redirected = false;
-                if (!commands[0].infile.empty()) {
-                    saved_stdin = dup(STDIN_FILENO);
-                    int fd = open(commands[0].infile.c_str(), O_RDONLY);
-                    if (fd >= 0) { dup2(fd, STDIN_FILENO); close(fd); redirected = true; }
-                }
-                if (!commands[0].outfile.empty()) {
-                    saved_stdout = dup(STDOUT_FILENO);
-                    int flags = O_WRONLY | O_CREAT | (commands[0].append ? O_APPEND : O_TRUNC);
-                    int fd = open(commands[0].outfile.c_str(), flags, 0644);
-                    if (fd >= 0) { dup2(fd, STDOUT_FILENO); close(fd); redirected = true; }
-                }
-                std::vector<std::string> words;
-                for (auto p : commands[0].argv) { if (!p) break; words.push_back(std::string(p)); }
-                builtin_execute(words);
-                if (redirected) {
-                    if (saved_stdin != -1) { dup2(saved_stdin, STDIN_FILENO); close(saved_stdin); }
-                    if (saved_stdout != -1) { dup2(saved_stdout, STDOUT_FILENO); close(saved_stdout); }
-                }
-                for (auto &c : commands) free_command_args(c);
-                continue;
-            }
+// Ctrl-C at the prompt: throw away the partial line and start a fresh one.
+static void interrupt_input_line() {
+#ifdef SHELL_NO_READLINE
+    tcflush(STDIN_FILENO, TCIFLUSH);
+    std::cout << "\n";
+    redraw_input_line();
+#else
+    rl_free_line_state();
+    rl_callback_sigcleanup();
+    rl_crlf();
+    rl_on_new_line();
+    rl_replace_line("", 0);
+    rl_redisplay();
+#endif
+}
+
+void handle_signal_events() {
+    bool got_chld, got_int;
+    drain_signal_events(got_chld, got_int);
+    if (got_chld) reap_children();
+    if (got_int && interactive) interrupt_input_line();
+}
+
+// ---------- Arena ----------
+// Bump-pointer allocator owning everything parsed from one input line: argv
+// strings and arrays, redirection paths and the Command nodes themselves.
+// reset() releases it all at once once the line has run.
+class Arena {
+public:
+    Arena() = default;
+    explicit Arena(size_t block_size) : block_size_(block_size) {}
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+    ~Arena() { for (auto b : blocks_) free(b.data); }
+
+    void *alloc(size_t n, size_t align = alignof(std::max_align_t)) {
+        size_t off = (used_ + align - 1) & ~(align - 1);
+        if (blocks_.empty() || off + n > blocks_[cur_].size) {
+            next_block(n + align);
+            off = 0;
         }
+        used_ = off + n;
+        return blocks_[cur_].data + off;
+    }
 
-        launch_pipeline(commands, background, line);
+    // Value-initialized array; only for trivially destructible types.
+    template <typename T> T *make_array(size_t n) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        T *p = static_cast<T*>(alloc(sizeof(T) * (n ? n : 1), alignof(T)));
+        for (size_t i = 0; i < n; ++i) new (p + i) T();
+        return p;
+    }
 
-        for (auto &c : commands) free_command_args(c);
-        remove_finished_jobs();
+    char *copy(std::string_view s) {
+        char *p = static_cast<char*>(alloc(s.size() + 1, 1));
+        memcpy(p, s.data(), s.size());
+        p[s.size()] = '\0';
+        return p;
     }
 
-    return 0;
-}
+    // Keeps the first block for the next line; blocks a long line needed go back.
+    void reset() {
+        for (size_t i = 1; i < blocks_.size(); ++i) free(blocks_[i].data);
+        if (blocks_.size() > 1) blocks_.resize(1);
+        cur_ = 0;
+        used_ = 0;
+    }
+
+private:
+    struct Block { char *data; size_t size; };
+    static constexpr size_t kBlockSize = 4096;
+
+    void next_block(size_t min) {
+        if (cur_ + 1 < blocks_.size() && blocks_[cur_ + 1].size >= min) { ++cur_; used_ = 0; return; }
+        size_t size = std::max(min, block_size_);
+        Block b{static_cast<char*>(malloc(size)), size};
+        if (!b.data) throw std::bad_alloc();
+        blocks_.push_back(b);
+        cur_ = blocks_.size() - 1;
+        used_ = 0;
+    }
 
+    std::vector<Block> blocks_;
+    size_t block_size_ = kBlockSize;
+    size_t cur_ = 0;
+    size_t used_ = 0;
+};
+
+// ---------- Parsing ----------
+// One left-to-right pass over the line: words are string_views into the
+// caller's buffer until they are copied, once, into the arena. Only words
+// whose quotes have to be removed mid-word are rebuilt in a scratch string.
+// Everything a Pipeline points at lives in the Arena it was parsed into.
+// Words that need expansion ($, ~, globs, backslashes) are stored raw and
+// flagged; expand_pipeline() turns them into final argv right before the
+// pipeline runs.
+// One redirection. A stage's redirections are applied in the order written,
+// after its pipe ends, so `>out 2>&1` and `2>&1 >out` differ as in sh.
+struct Redirect {
+    enum Kind : unsigned char { Open, Dup, Close, Here };
+    Kind kind = Open;
+    unsigned char raw = 0;       // `word` still to expand (see below)
+    int fd = 0;                  // the descriptor it sets up
+    int flags = 0;               // open(2) flags of an Open
+    int src = -1;                // what a Dup copies
+    const char *word = nullptr;  // file of an Open, text of a Here
+};
+
+struct Command {
+    char **argv = nullptr;         // NULL-terminated
+    int argc = 0;
+    Redirect *redirs = nullptr;
+    int nredirs = 0;
+    char **assigns = nullptr;      // NAME=value prefixes
+    int nassigns = 0;
+    unsigned char *raw = nullptr;  // per argv word, or null when none is raw
+    unsigned char *raw_assigns = nullptr;
+    int npass = 0;
+    const int *pass_fds = nullptr; // process substitution pipes the stage keeps
+    const char *exec_path = nullptr;  // resolved argv[0], set by the line cache
+    const cpu_set_t *cpus = nullptr;  // placement, set at launch
+    int mem_node = -1;
+};
+
+// Raw flags other than 1 ("expand me"): a process substitution, stored as
+// the text of its command. <(cmd) is read from, >(cmd) written to.
+enum : unsigned char { RawProcIn = 2, RawProcOut = 3 };
+// How the text of a Here is still to be expanded: a here-document body with
+// an unquoted delimiter ($ and \ only), or the word of a here-string.
+enum : unsigned char { HereBody = 1, HereWord = 2 };
+
+// `limit` options: the job runs in a cgroup leaf of its own with these caps.
+struct JobLimits {
+    size_t mem = 0;              // memory.max in bytes; 0 = no cap
+    uint64_t cpu_quota = 0;      // cpu.max microseconds per cpu_period; 0 = no cap
+    const char *io = nullptr;    // io.max line, e.g. "8:0 wbps=1048576"
+};
+static const uint64_t cpu_period = 100000;
+
+// `place` options: which CPUs the stages run on and where their memory comes from.
+struct Placement {
+    cpu_set_t *cpus = nullptr;   // one set per ':'-separated list; the last repeats
+    size_t ncpus = 0;
+    bool automatic = false;      // `auto`: all stages on the CPUs of one LLC
+    int node = -1;               // --node: memory bound to it, CPUs default to its own
+};
+
+struct Pipeline {
+    Command *commands = nullptr;
+    size_t count = 0;
+    bool background = false;
+    bool timed = false;       // led by the `time` keyword
+    size_t pipebuf = 0;       // `PIPEBUF=size` prefix; 0 = the shell option
+    const JobLimits *limits = nullptr;   // `limit ...` prefix
+    const Placement *place = nullptr;    // `place ...` prefix
+    int cgroup_fd = -1;       // set at launch for a limited pipeline
+    std::string_view text;    // source text without the trailing '&'
+};
+
+// How a pipeline of a list leads to the next: `;` (and `&`) always, `&&`
+// if it succeeded, `||` if it failed.
+enum class ListOp : unsigned char { End, Seq, And, Or };
+
+// A line is a list of pipelines. `&` backgrounds the pipeline just before it.
+struct CommandList {
+    Pipeline *pipelines = nullptr;
+    ListOp *ops = nullptr;    // ops[k] joins pipelines[k] to pipelines[k + 1]
+    size_t count = 0;
+};
+
+static inline bool is_operator_char(char c) {
+    return c == '|' || c == '<' || c == '>' || c == '&' || c == ';';
+}
+
+// Index of the '`' closing the one at line[open]; npos when there is none.
+static size_t find_backquote(std::string_view line, size_t open) {
+    for (size_t i = open + 1; i < line.size(); ++i) {
+        if (line[i] == '\\') ++i;
+        else if (line[i] == '`') return i;
+    }
+    return std::string_view::npos;
+}
+
+// Index of the ')' or '}' closing the '(' or '{' at line[open], skipping
+// quoted text, nested pairs and nested $(...) or ${...}; npos when there
+// is none.
+static size_t match_close(std::string_view line, size_t open) {
+    const char opener = line[open], closer = opener == '{' ? '}' : ')';
+    int depth = 0;
+    char q = 0;
+    for (size_t i = open; i < line.size(); ++i) {
+        char c = line[i];
+        if (q) {
+            if (c == '\\' && q == '"') ++i;
+            else if (c == q) q = 0;
+        } else if (c == '\\') {
+            ++i;
+        } else if (c == '`') {
+            i = find_backquote(line, i);
+            if (i == std::string_view::npos) return i;
+        } else if (c == '$' && i + 1 < line.size() && (line[i + 1] == '(' || line[i + 1] == '{')) {
+            i = match_close(line, i + 1);
+            if (i == std::string_view::npos) return i;
+        } else if (c == '\'' || c == '"') {
+            q = c;
+        } else if (c == opener) {
+            ++depth;
+        } else if (c == closer && --depth == 0) {
+            return i;
+        }
+    }
+    return std::string_view::npos;
+}
+
+// The characters lex_word() has to look at outside quotes; most of a line
+// is none of them and is skipped with one table lookup each.
+static const struct LexTable {
+    bool special[256] = {};
+    LexTable() { for (unsigned char c : std::string_view(" \t\n\v\f\r|<>&;'\"\\$`*?~[]")) special[c] = true; }
+} lex_table;
+
+// Scans the word starting at line[i] and advances i past it. Returns an
+// error message, or nullptr. A word with nothing to expand comes back with
+// its quotes removed; one that needs expansion comes back as written, with
+// `raw` set. ${...}, $(...) and `...` are skipped as units, so they may
+// hold spaces and operators.
+static const char *lex_word(std::string_view line, size_t &i, std::string &scratch,
+                            std::string_view &word, bool &raw) {
+    size_t start = i;
+    size_t quotes = 0;
+    char q = 0;
+    bool bracket = false;
+    raw = false;
+    while (i < line.size()) {
+        char c = line[i];
+        if (!q && !lex_table.special[(unsigned char)c]) {
+            ++i;
+            continue;
+        }
+        if (q == '\'') {
+            if (c == q) q = 0;
+        } else if (c == '\\') {
+            raw = true;
+            if (i + 1 < line.size()) ++i;
+        } else if (c == '$') {
+            raw = true;
+            if (i + 1 < line.size() && line[i + 1] == '{') {
+                size_t close = match_close(line, i + 1);
+                if (close == std::string_view::npos) return "bad substitution";
+                i = close;
+            } else if (i + 1 < line.size() && line[i + 1] == '(') {
+                size_t close = match_close(line, i + 1);
+                if (close == std::string_view::npos) return "unterminated command substitution";
+                i = close;
+            }
+        } else if (c == '`') {
+            raw = true;
+            i = find_backquote(line, i);
+            if (i == std::string_view::npos) return "unterminated command substitution";
+        } else if (q == '"') {
+            if (c == q) q = 0;
+        } else if (c == '\'' || c == '"') {
+            q = c;
+            ++quotes;
+        } else if (isspace((unsigned char)c) || is_operator_char(c)) {
+            break;
+        } else if (c == '*' || c == '?') {
+            raw = true;
+        } else if (c == '~' && (i == start || line[i - 1] == '=')) {
+            raw = true;
+        } else if (c == '[') {
+            bracket = true;
+        } else if (c == ']' && bracket) {
+            raw = true;
+        }
+        ++i;
+    }
+    if (q) return "unterminated quote";
+    word = line.substr(start, i - start);
+    if (raw || quotes == 0) return nullptr;
+    if (quotes == 1 && word.front() == word.back() && (word.front() == '"' || word.front() == '\'')) {
+        word = word.substr(1, word.size() - 2);
+        return nullptr;
+    }
+    scratch.clear();
+    for (char c : word) {
+        if (q) { if (c == q) q = 0; else scratch.push_back(c); }
+        else if (c == '\'' || c == '"') q = c;
+        else scratch.push_back(c);
+    }
+    word = scratch;
+    return nullptr;
+}
+
+// A here-document delimiter as written, with its quotes removed; any
+// quoting at all turns off expansion of the body.
+static std::string heredoc_delimiter(std::string_view raw, bool &quoted) {
+    std::string d;
+    char q = 0;
+    quoted = false;
+    for (size_t i = 0; i < raw.size(); ++i) {
+        char c = raw[i];
+        if (q == '\'') { if (c == q) q = 0; else d += c; continue; }
+        if (c == '\\' && i + 1 < raw.size() && (!q || strchr("\"\\$`", raw[i + 1]))) {
+            quoted = true;
+            d += raw[++i];
+        } else if (q && c == q) {
+            q = 0;
+        } else if (!q && (c == '\'' || c == '"')) {
+            q = c;
+            quoted = true;
+        } else {
+            d += c;
+        }
+    }
+    return d;
+}
+
+struct HereDelim {
+    std::string word;
+    bool strip_tabs;   // <<-
+};
+
+// The here-documents a command line opens, in order. Readers use this to
+// fetch the bodies that follow the line before it is parsed.
+static void heredoc_delimiters(std::string_view line, std::vector<HereDelim> &delims) {
+    std::string scratch;
+    std::string_view word;
+    bool raw;
+    size_t i = 0;
+    while (i < line.size()) {
+        char c = line[i];
+        if (isspace((unsigned char)c)) { ++i; continue; }
+        if (c == '#') break;
+        if ((c == '<' || c == '>') && i + 1 < line.size() && line[i + 1] == '(') {
+            size_t close = match_close(line, i + 1);
+            if (close == std::string_view::npos) break;
+            i = close + 1;
+        } else if (line.compare(i, 3, "<<<") == 0) {
+            i += 3;
+        } else if (line.compare(i, 2, "<<") == 0) {
+            i += 2;
+            bool strip = i < line.size() && line[i] == '-';
+            if (strip) ++i;
+            while (i < line.size() && isspace((unsigned char)line[i])) ++i;
+            size_t start = i;
+            if (i >= line.size() || is_operator_char(line[i]) || lex_word(line, i, scratch, word, raw)) break;
+            bool quoted;
+            delims.push_back({heredoc_delimiter(line.substr(start, i - start), quoted), strip});
+        } else if (is_operator_char(c)) {
+            ++i;
+        } else if (lex_word(line, i, scratch, word, raw)) {
+            break;
+        }
+    }
+}
+
+// Appends to `line` the lines its here-documents take, got from `next`
+// (false at end of input), up to and including each delimiter line. The
+// parser then finds the bodies after the first newline.
+template <typename Next> void read_heredoc_bodies(std::string &line, Next next) {
+    if (line.find("<<") == std::string::npos) return;
+    std::vector<HereDelim> delims;
+    heredoc_delimiters(line, delims);
+    std::string more;
+    for (auto &d : delims) {
+        while (next(more)) {
+            line += '\n';
+            line += more;
+            std::string_view l = more;
+            if (d.strip_tabs) l.remove_prefix(std::min(l.find_first_not_of('\t'), l.size()));
+            if (l == d.word) break;
+        }
+    }
+}
+
+// Moves the body of the here-document delimited by `raw` from the front of
+// `bodies` into `r`. Input that ends early ends the body, as in bash.
+static void take_heredoc_body(std::string_view raw, bool strip_tabs, std::string_view &bodies,
+                              Arena &arena, Redirect &r) {
+    bool quoted;
+    std::string delim = heredoc_delimiter(raw, quoted), body;
+    while (!bodies.empty()) {
+        size_t nl = std::min(bodies.find('\n'), bodies.size());
+        std::string_view l = bodies.substr(0, nl);
+        bodies.remove_prefix(std::min(nl + 1, bodies.size()));
+        if (strip_tabs) l.remove_prefix(std::min(l.find_first_not_of('\t'), l.size()));
+        if (l == delim) break;
+        body.append(l.data(), l.size());
+        body += '\n';
+    }
+    r.kind = Redirect::Here;
+    r.word = arena.copy(body);
+    r.raw = !quoted && body.find_first_of("$\\") != std::string::npos ? HereBody : 0;
+}
+
+static bool parse_error(const char *what) {
+    std::cerr << "Parse error: " << what << "\n";
+    return false;
+}
+
+// Parses the pipeline starting at line[i] into `pl`, allocating from
+// `arena`, and stops past the list operator that ends it, reported in `op`
+// (End at the end of the line). An empty or comment-only rest of the line
+// yields no commands. Here-document bodies are taken from the front of
+// `bodies`; without it, `<<` is an error.
+static bool parse_pipeline(std::string_view line, size_t &i, Arena &arena, Pipeline &pl, ListOp &op,
+                           std::string_view *bodies = nullptr) {
+    // Words and stages are staged in reused buffers, then copied into exactly
+    // sized arena arrays; after warm-up a parse does no heap allocation.
+    static std::vector<char*> words, assigns;
+    static std::vector<unsigned char> word_raw, assign_raw;
+    static std::vector<Redirect> redirs;
+    static std::vector<Command> stages;
+    words.clear();
+    word_raw.clear();
+    assigns.clear();
+    assign_raw.clear();
+    redirs.clear();
+    stages.clear();
+
+    enum { NoRedir, RedirFile, RedirDup, HereDoc, HereDocTabs, HereString } pending = NoRedir;
+    Redirect redir;       // the one `pending` is for
+    bool and_err = false; // &> and &>>: stderr follows stdout
+    bool dup_out = false; // >& rather than <&
+    int io_fd = -1;       // `2` of 2>file
+    Command cur;
+    std::string scratch;
+    while (i < line.size() && isspace((unsigned char)line[i])) ++i;
+    size_t begin = i, text_end = i;
+    pl = Pipeline();
+    op = ListOp::End;
+
+    bool any_raw = false;   // in the current stage
+    auto flags_array = [&](const std::vector<unsigned char> &flags) -> unsigned char * {
+        if (!any_raw) return nullptr;
+        unsigned char *a = arena.make_array<unsigned char>(flags.size());
+        std::copy(flags.begin(), flags.end(), a);
+        return a;
+    };
+    auto end_stage = [&]() {
+        cur.argc = static_cast<int>(words.size());
+        cur.argv = arena.make_array<char*>(words.size() + 1);
+        std::copy(words.begin(), words.end(), cur.argv);
+        cur.raw = flags_array(word_raw);
+        if (!assigns.empty()) {
+            cur.nassigns = static_cast<int>(assigns.size());
+            cur.assigns = arena.make_array<char*>(assigns.size() + 1);
+            std::copy(assigns.begin(), assigns.end(), cur.assigns);
+            cur.raw_assigns = flags_array(assign_raw);
+        }
+        if (!redirs.empty()) {
+            cur.nredirs = static_cast<int>(redirs.size());
+            cur.redirs = arena.make_array<Redirect>(redirs.size());
+            std::copy(redirs.begin(), redirs.end(), cur.redirs);
+        }
+        stages.push_back(cur);
+        words.clear();
+        word_raw.clear();
+        assigns.clear();
+        assign_raw.clear();
+        redirs.clear();
+        any_raw = false;
+        cur = Command();
+    };
+    auto stage_empty = [&]() { return words.empty() && assigns.empty(); };
+    // The target word of `pending`, lexed as `word`; raw words are kept as
+    // written for expand_pipeline()
+    auto end_redirect = [&](std::string_view word, std::string_view raw, unsigned char raw_word) -> bool {
+        switch (pending) {
+        case RedirFile:
+            redir.word = arena.copy(word);
+            redir.raw = raw_word;
+            break;
+        case RedirDup:
+            if (raw_word) {
+                redir.word = arena.copy(word);
+                redir.raw = 1;
+            } else if (word == "-") {
+                redir.kind = Redirect::Close;
+            } else if (!word.empty() && word.size() <= 4 && word.find_first_not_of("0123456789") == std::string_view::npos) {
+                redir.src = atoi(std::string(word).c_str());
+            } else if (redir.fd == STDOUT_FILENO && dup_out) {
+                // >&file is &>file
+                redir.kind = Redirect::Open;
+                redir.flags = O_WRONLY | O_CREAT | O_TRUNC;
+                redir.word = arena.copy(word);
+                and_err = true;
+            } else {
+                return parse_error("bad file descriptor in redirection");
+            }
+            break;
+        case HereString:
+            // The word plus a newline, like bash; expanded without splitting
+            redir.kind = Redirect::Here;
+            redir.word = raw_word ? arena.copy(raw) : arena.copy(std::string(word) + "\n");
+            redir.raw = raw_word ? HereWord : 0;
+            break;
+        case HereDoc: case HereDocTabs:
+            if (!bodies) return parse_error("here-document: the body must follow on the next lines");
+            take_heredoc_body(raw, pending == HereDocTabs, *bodies, arena, redir);
+            break;
+        case NoRedir:
+            break;
+        }
+        redirs.push_back(redir);
+        if (and_err) {
+            Redirect err;
+            err.kind = Redirect::Dup;
+            err.fd = STDERR_FILENO;
+            err.src = STDOUT_FILENO;
+            redirs.push_back(err);
+        }
+        pending = NoRedir;
+        return true;
+    };
+
+    while (true) {
+        while (i < line.size() && isspace((unsigned char)line[i])) ++i;
+        if (i >= line.size() || line[i] == '#') break;
+        char c = line[i];
+        bool doubled = i + 1 < line.size() && line[i + 1] == c;
+        if (c == ';' || (doubled && (c == '&' || c == '|'))) {
+            if (pending != NoRedir) return parse_error("missing redirection target");
+            if (stage_empty()) {
+                if (stages.empty()) return parse_error(c == ';' ? "nothing before ';'" : c == '&' ? "nothing before '&&'" : "nothing before '||'");
+                return parse_error("empty pipeline stage");
+            }
+            op = c == ';' ? ListOp::Seq : c == '&' ? ListOp::And : ListOp::Or;
+            i += doubled ? 2 : 1;
+            break;
+        }
+        if (c == '|' || (c == '&' && !(i + 1 < line.size() && line[i + 1] == '>'))) {
+            if (pending != NoRedir) return parse_error("missing redirection target");
+            if (stage_empty()) return parse_error(c == '|' ? "empty pipeline stage" : "nothing to run in background");
+            end_stage();
+            ++i;
+            if (c == '|') {
+                text_end = i;
+                continue;
+            }
+            pl.background = true;
+            op = ListOp::Seq;
+            break;
+        }
+        if ((c == '<' || c == '>') && i + 1 < line.size() && line[i + 1] == '(') {
+            // <(cmd) and >(cmd) become a /dev/fd path when the line runs
+            size_t close = match_close(line, i + 1);
+            if (close == std::string_view::npos) return parse_error("unterminated process substitution");
+            char *text = arena.copy(line.substr(i + 2, close - i - 2));
+            unsigned char kind = c == '<' ? RawProcIn : RawProcOut;
+            i = close + 1;
+            text_end = i;
+            if (pending == NoRedir) {
+                words.push_back(text);
+                word_raw.push_back(kind);
+                any_raw = true;
+                continue;
+            }
+            if (pending != RedirFile) return parse_error("process substitution can only name a file here");
+            if (!end_redirect(text, text, kind)) return false;
+            continue;
+        }
+        if (c == '<' || c == '>' || c == '&') {
+            // <  >  >>  <>  <&N  >&N  N>&-  &>  &>>  <<WORD  <<-WORD  <<<word
+            if (pending != NoRedir) return parse_error("missing redirection target");
+            redir = Redirect();
+            and_err = c == '&';
+            dup_out = false;
+            if (and_err) c = line[++i];
+            redir.fd = io_fd >= 0 ? io_fd : c == '<' ? STDIN_FILENO : STDOUT_FILENO;
+            io_fd = -1;
+            std::string_view rest = line.substr(i);
+            size_t len = 1;
+            pending = RedirFile;
+            if (c == '<') {
+                if (rest.substr(0, 3) == "<<<") { pending = HereString; len = 3; }
+                else if (rest.substr(0, 3) == "<<-") { pending = HereDocTabs; len = 3; }
+                else if (rest.substr(0, 2) == "<<") { pending = HereDoc; len = 2; }
+                else if (rest.substr(0, 2) == "<&") { pending = RedirDup; len = 2; }
+                else if (rest.substr(0, 2) == "<>") { redir.flags = O_RDWR | O_CREAT; len = 2; }
+                else redir.flags = O_RDONLY;
+                if (and_err) return parse_error("&< is not a redirection");
+            } else if (rest.substr(0, 2) == ">>") {
+                redir.flags = O_WRONLY | O_CREAT | O_APPEND;
+                len = 2;
+            } else if (rest.substr(0, 2) == ">&" && !and_err) {
+                pending = RedirDup;
+                dup_out = true;
+                len = 2;
+            } else {
+                redir.flags = O_WRONLY | O_CREAT | O_TRUNC;
+                if (rest.substr(0, 2) == ">|") len = 2;
+            }
+            if (pending == RedirDup) redir.kind = Redirect::Dup;
+            i += len;
+            continue;
+        }
+        std::string_view word;
+        size_t word_start = i;
+        bool raw_word;
+        if (const char *err = lex_word(line, i, scratch, word, raw_word)) return parse_error(err);
+        // A number written against < or > is the fd it redirects: 2>err
+        if (pending == NoRedir && !raw_word && i < line.size() && (line[i] == '<' || line[i] == '>') &&
+            !(i + 1 < line.size() && line[i + 1] == '(') && i - word_start <= 4 &&
+            line.substr(word_start, i - word_start).find_first_not_of("0123456789") == std::string_view::npos) {
+            io_fd = atoi(std::string(line.substr(word_start, i - word_start)).c_str());
+            continue;
+        }
+        // `time` is a keyword only as the unquoted first word of the pipeline
+        if (pending == NoRedir && stage_empty() && stages.empty() && !pl.timed &&
+            line.substr(word_start, i - word_start) == "time") {
+            pl.timed = true;
+            continue;
+        }
+        // ...and so is a leading PIPEBUF=size, which sizes this pipeline's pipes
+        std::string_view raw = line.substr(word_start, i - word_start);
+        if (pending == NoRedir && stage_empty() && stages.empty() && !pl.pipebuf &&
+            raw.substr(0, 8) == "PIPEBUF=") {
+            if (!parse_size(raw.substr(8), pl.pipebuf)) return parse_error("PIPEBUF: invalid size");
+            continue;
+        }
+        // ...and a leading `limit [--mem SIZE] [--cpu N] [--io SPEC]`
+        if (pending == NoRedir && stage_empty() && stages.empty() && !pl.limits && raw == "limit") {
+            JobLimits *lim = arena.make_array<JobLimits>(1);
+            pl.limits = lim;
+            while (true) {
+                while (i < line.size() && isspace((unsigned char)line[i])) ++i;
+                std::string_view opt;
+                bool opt_raw;
+                if (i >= line.size() || line.compare(i, 2, "--") != 0) break;
+                if (const char *err = lex_word(line, i, scratch, opt, opt_raw)) return parse_error(err);
+                std::string name(opt), value;
+                size_t eq = name.find('=');
+                if (eq != std::string::npos) {
+                    value = name.substr(eq + 1);
+                    name.resize(eq);
+                } else {
+                    while (i < line.size() && isspace((unsigned char)line[i])) ++i;
+                    std::string_view v;
+                    if (i >= line.size() || is_operator_char(line[i])) return parse_error("limit: option needs a value");
+                    if (const char *err = lex_word(line, i, scratch, v, opt_raw)) return parse_error(err);
+                    value = std::string(v);
+                }
+                if (name == "--mem") {
+                    if (!parse_size(value, lim->mem)) return parse_error("limit: --mem: invalid size");
+                } else if (name == "--cpu") {
+                    char *end;
+                    double cpus = strtod(value.c_str(), &end);
+                    if (*end || !(cpus > 0)) return parse_error("limit: --cpu: expected a number of CPUs");
+                    lim->cpu_quota = std::max<uint64_t>(1000, static_cast<uint64_t>(cpus * cpu_period));
+                } else if (name == "--io") {
+                    lim->io = arena.copy(value);
+                } else {
+                    return parse_error("limit: unknown option");
+                }
+            }
+            continue;
+        }
+        // ...and a leading `place [--node N] [auto | CPUS[:CPUS...]]`
+        if (pending == NoRedir && stage_empty() && stages.empty() && !pl.place && raw == "place") {
+            Placement *place = arena.make_array<Placement>(1);
+            pl.place = place;
+            while (true) {
+                while (i < line.size() && isspace((unsigned char)line[i])) ++i;
+                size_t arg_start = i;
+                std::string_view arg;
+                bool arg_raw;
+                if (i >= line.size() || is_operator_char(line[i])) break;
+                if (const char *err = lex_word(line, i, scratch, arg, arg_raw)) return parse_error(err);
+                if (arg == "--node" || arg.substr(0, 7) == "--node=") {
+                    std::string value(arg.size() > 7 ? arg.substr(7) : std::string_view());
+                    if (arg.size() == 6) {
+                        while (i < line.size() && isspace((unsigned char)line[i])) ++i;
+                        std::string_view v;
+                        if (i >= line.size() || is_operator_char(line[i])) return parse_error("place: --node needs a value");
+                        if (const char *err = lex_word(line, i, scratch, v, arg_raw)) return parse_error(err);
+                        value = std::string(v);
+                    }
+                    char *end;
+                    long node = strtol(value.c_str(), &end, 10);
+                    if (value.empty() || *end || node < 0 || node >= 1024) return parse_error("place: --node: invalid node");
+                    place->node = static_cast<int>(node);
+                    continue;
+                }
+                if (place->automatic || place->ncpus) { i = arg_start; break; }
+                if (arg == "auto") {
+                    place->automatic = true;
+                    continue;
+                }
+                if (arg.find_first_not_of("0123456789,-:") != std::string_view::npos) { i = arg_start; break; }
+                place->ncpus = std::count(arg.begin(), arg.end(), ':') + 1;
+                place->cpus = arena.make_array<cpu_set_t>(place->ncpus);
+                size_t from = 0;
+                for (size_t k = 0; k < place->ncpus; ++k) {
+                    size_t to = std::min(arg.find(':', from), arg.size());
+                    if (!parse_cpulist(arg.substr(from, to - from), place->cpus[k]))
+                        return parse_error("place: invalid CPU list");
+                    from = to + 1;
+                }
+            }
+            if (!place->automatic && !place->ncpus && place->node < 0)
+                return parse_error("place: expected auto, a CPU list or --node N");
+            continue;
+        }
+        text_end = i;
+        // NAME=value before the command word is an assignment; the name
+        // must be written plainly, the value may be quoted or expanded.
+        any_raw |= raw_word;
+        if (pending == NoRedir && words.empty() && is_name_start(raw[0])) {
+            size_t eq = raw.find('=');
+            if (eq != std::string_view::npos && valid_name(raw.substr(0, eq))) {
+                assigns.push_back(arena.copy(word));
+                assign_raw.push_back(raw_word);
+                continue;
+            }
+        }
+        if (pending != NoRedir) {
+            if (!end_redirect(word, raw, raw_word)) return false;
+            continue;
+        }
+        words.push_back(arena.copy(word));
+        word_raw.push_back(raw_word);
+    }
+
+    if (pending != NoRedir) return parse_error("missing redirection target");
+    if (op != ListOp::End) {
+        // A trailing ';' or '&' ends the list; '&&' and '||' need more
+        size_t rest = i;
+        while (rest < line.size() && isspace((unsigned char)line[rest])) ++rest;
+        if (rest >= line.size() || line[rest] == '#') {
+            if (op != ListOp::Seq) return parse_error(op == ListOp::And ? "nothing after '&&'" : "nothing after '||'");
+            op = ListOp::End;
+        }
+    }
+    if (pl.timed && stage_empty() && stages.empty()) return parse_error("time: nothing to time");
+    if (pl.pipebuf && stage_empty() && stages.empty()) return parse_error("PIPEBUF: nothing to run");
+    if (pl.limits && stage_empty() && stages.empty()) return parse_error("limit: nothing to run");
+    if (pl.place && stage_empty() && stages.empty()) return parse_error("place: nothing to run");
+    if (!stage_empty()) end_stage();
+    else if (!stages.empty() && !pl.background) return parse_error("empty pipeline stage");
+
+    pl.count = stages.size();
+    pl.commands = arena.make_array<Command>(stages.size());
+    std::copy(stages.begin(), stages.end(), pl.commands);
+    pl.text = line.substr(begin, text_end - begin);
+    if (pl.timed) {
+        size_t first = pl.text.find("time") + 4;
+        first = pl.text.find_first_not_of(" \t", first);
+        pl.text = pl.text.substr(first == std::string_view::npos ? pl.text.size() : first);
+    }
+    return true;
+}
+
+// Parses a line that must hold a single pipeline, such as a parallel template.
+bool parse_line(std::string_view line, Arena &arena, Pipeline &pl) {
+    size_t i = 0;
+    ListOp op;
+    if (!parse_pipeline(line, i, arena, pl, op)) return false;
+    if (op != ListOp::End) return parse_error("only one pipeline is allowed here");
+    return true;
+}
+
+// Parses a whole input line: pipelines joined by ;, &, && and ||. Lines
+// after the first are the bodies of its here-documents.
+bool parse_list(std::string_view line, Arena &arena, CommandList &list) {
+    static std::vector<Pipeline> pipelines;
+    static std::vector<ListOp> ops;
+    pipelines.clear();
+    ops.clear();
+    size_t nl = std::min(line.find('\n'), line.size());
+    std::string_view bodies = line.substr(std::min(nl + 1, line.size()));
+    line = line.substr(0, nl);
+    size_t i = 0;
+    ListOp op;
+    do {
+        Pipeline pl;
+        if (!parse_pipeline(line, i, arena, pl, op, &bodies)) return false;
+        if (pl.count == 0) break;
+        pipelines.push_back(pl);
+        ops.push_back(op);
+    } while (op != ListOp::End);
+    list.count = pipelines.size();
+    list.pipelines = arena.make_array<Pipeline>(list.count);
+    std::copy(pipelines.begin(), pipelines.end(), list.pipelines);
+    list.ops = arena.make_array<ListOp>(list.count);
+    std::copy(ops.begin(), ops.end(), list.ops);
+    return true;
+}
+
+// ---------- Variables ----------
+// Shell variables live in one table. Exported ones are also mirrored into
+// the process environment, so getenv() callers stay right, and serialized
+// into shell_envp(), which is rebuilt only after an exported variable
+// changed instead of on every launch.
+struct ShellVar {
+    std::string value;
+    bool exported = false;
+};
+
+static std::unordered_map<std::string, ShellVar> shell_vars;
+static std::vector<std::string> envp_strings;
+static std::vector<char*> envp_cache;
+static bool envp_dirty = true;
+static std::string shell_name = "mini-shell";   // $0
+static std::vector<std::string> positional;     // $1, $2, ...
+static pid_t shell_pid = 0;                     // $$, also in forked stages
+static pid_t last_bg_pid = 0;                   // $!
+static std::vector<int> pipe_status{0};         // ${PIPESTATUS[@]}
+
+static void exec_hash_sync_path();
+
+void vars_init() {
+    shell_pid = getpid();
+    for (char **e = environ; *e; ++e) {
+        const char *eq = strchr(*e, '=');
+        if (!eq) continue;
+        ShellVar &v = shell_vars[std::string(*e, eq - *e)];
+        v.value = eq + 1;
+        v.exported = true;
+    }
+}
+
+const std::string *var_get(const std::string &name) {
+    auto it = shell_vars.find(name);
+    return it == shell_vars.end() ? nullptr : &it->second.value;
+}
+
+void var_set(const std::string &name, std::string value, bool export_it = false) {
+    ShellVar &v = shell_vars[name];
+    v.value = std::move(value);
+    if (export_it) v.exported = true;
+    if (v.exported) {
+        setenv(name.c_str(), v.value.c_str(), 1);
+        envp_dirty = true;
+    }
+    if (name == "PATH") exec_hash_sync_path();
+}
+
+void var_unset(const std::string &name) {
+    auto it = shell_vars.find(name);
+    if (it == shell_vars.end()) return;
+    if (it->second.exported) {
+        unsetenv(name.c_str());
+        envp_dirty = true;
+    }
+    shell_vars.erase(it);
+    if (name == "PATH") exec_hash_sync_path();
+}
+
+char **shell_envp() {
+    if (envp_dirty) {
+        envp_strings.clear();
+        for (auto &kv : shell_vars)
+            if (kv.second.exported) envp_strings.push_back(kv.first + "=" + kv.second.value);
+        envp_cache.clear();
+        for (auto &s : envp_strings) envp_cache.push_back(&s[0]);
+        envp_cache.push_back(nullptr);
+        envp_dirty = false;
+    }
+    return envp_cache.data();
+}
+
+// Records the exit codes of a finished pipeline, one per stage. $? is the
+// last stage's, or with pipefail the last one that failed.
+static void set_pipeline_status(std::vector<int> codes) {
+    pipe_status = std::move(codes);
+    last_status = pipe_status.back();
+    if (opt_pipefail)
+        for (int c : pipe_status) if (c != 0) last_status = c;
+}
+
+static const char *expand_word(std::string_view raw, std::vector<std::string> &fields, bool split);
+
+// Sets the NAME=value words of `cmd` as shell variables. The words of an
+// assignment-only command are still raw: each is expanded once the ones
+// before it are set, so `x=1 y=$x` sees the new x. False, with the error
+// printed, when one can't be expanded.
+static bool assign_vars(const Command &cmd) {
+    for (int a = 0; a < cmd.nassigns; ++a) {
+        const char *eq = strchr(cmd.assigns[a], '=');
+        std::string name(cmd.assigns[a], eq - cmd.assigns[a]);
+        if (!cmd.raw_assigns || !cmd.raw_assigns[a]) { var_set(name, eq + 1); continue; }
+        std::vector<std::string> fields;
+        if (const char *err = expand_word(eq + 1, fields, false)) {
+            std::cerr << cmd.assigns[a] << ": " << err << "\n";
+            return false;
+        }
+        var_set(name, fields[0]);
+    }
+    return true;
+}
+
+// Prefix assignments on a builtin that runs in the shell last for that one
+// command; restore() puts the previous values back.
+struct TempAssigns {
+    struct Saved { std::string name; bool had; ShellVar old; };
+    std::vector<Saved> saved;
+
+    void apply(const Command &cmd) {
+        for (int a = 0; a < cmd.nassigns; ++a) {
+            const char *eq = strchr(cmd.assigns[a], '=');
+            std::string name(cmd.assigns[a], eq - cmd.assigns[a]);
+            auto it = shell_vars.find(name);
+            saved.push_back({name, it != shell_vars.end(), it != shell_vars.end() ? it->second : ShellVar()});
+        }
+        assign_vars(cmd);
+    }
+
+    void restore() {
+        for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+            var_unset(it->name);
+            if (it->had) var_set(it->name, it->old.value, it->old.exported);
+        }
+        saved.clear();
+    }
+};
+
+// ---------- Expansion ----------
+// Runs over the raw words parse_line() flagged: tilde, parameters, quote
+// removal, IFS field splitting and pathname globbing, in that order. Each
+// output character carries where it came from, so only unquoted expansion
+// results are split and only unquoted characters act as glob syntax.
+enum : char { FromQuote = 'q', FromText = 'u', FromExpansion = 'e' };
+
+static bool special_param(std::string_view name, std::string &out) {
+    if (name == "?") { out = std::to_string(last_status); return true; }
+    if (name == "$") { out = std::to_string(shell_pid); return true; }
+    if (name == "!") { out = last_bg_pid ? std::to_string(last_bg_pid) : ""; return last_bg_pid != 0; }
+    if (name == "#") { out = std::to_string(positional.size()); return true; }
+    if (name == "0") { out = shell_name; return true; }
+    if (name == "@" || name == "*") {
+        out = join_tokens(positional);
+        return !positional.empty();
+    }
+    size_t n = strtoul(std::string(name).c_str(), nullptr, 10);
+    if (n == 0 || n > positional.size()) return false;
+    out = positional[n - 1];
+    return true;
+}
+
+// Looks a parameter up; returns false when it is unset.
+static bool lookup_param(std::string_view name, std::string &out) {
+    if (!is_name_start(name[0])) return special_param(name, out);
+    const std::string *v = var_get(std::string(name));
+    if (!v && name == "PIPESTATUS") {
+        out = std::to_string(pipe_status[0]);
+        return true;
+    }
+    if (!v) return false;
+    out = *v;
+    return true;
+}
+
+static void command_subst(std::string_view text, std::string &out);
+
+// The `...` starting at raw[i]: runs it with the backslashes before `, $
+// and \ removed and advances i past it.
+static void backquote_subst(std::string_view raw, size_t &i, std::string &value) {
+    size_t close = find_backquote(raw, i);
+    if (close == std::string_view::npos) close = raw.size();
+    std::string text;
+    for (size_t k = i + 1; k < close; ++k) {
+        if (raw[k] == '\\' && k + 1 < close && strchr("`$\\", raw[k + 1])) ++k;
+        text += raw[k];
+    }
+    i = close + 1;
+    command_subst(text, value);
+}
+
+// Expands the parameter or $(...) starting at raw[i] == '$' and advances i
+// past it. Returns an error message, or nullptr; `value` receives the
+// expansion.
+static const char *expand_param(std::string_view raw, size_t &i, std::string &value, bool &literal) {
+    literal = false;
+    size_t p = i + 1;
+    if (p < raw.size() && raw[p] == '(') {
+        if (p + 1 < raw.size() && raw[p + 1] == '(') return "arithmetic expansion is not supported";
+        size_t close = match_close(raw, p);
+        if (close == std::string_view::npos) return "unterminated command substitution";
+        command_subst(raw.substr(p + 1, close - p - 1), value);
+        i = close + 1;
+        return nullptr;
+    }
+    if (p < raw.size() && raw[p] == '{') {
+        size_t close = match_close(raw, p);
+        if (close == std::string_view::npos) return "bad substitution";
+        std::string_view body = raw.substr(p + 1, close - p - 1);
+        i = close + 1;
+        if (body == "#PIPESTATUS[@]" || body == "#PIPESTATUS[*]") {
+            value = std::to_string(pipe_status.size());
+            return nullptr;
+        }
+        if (body.substr(0, 11) == "PIPESTATUS[" && body.back() == ']') {
+            // The one array: ${PIPESTATUS[N]}, ${PIPESTATUS[@]}
+            std::string_view index = body.substr(11, body.size() - 12);
+            value.clear();
+            if (index == "@" || index == "*") {
+                for (size_t k = 0; k < pipe_status.size(); ++k)
+                    value += (k ? " " : "") + std::to_string(pipe_status[k]);
+            } else {
+                size_t n = 0;
+                for (char d : index) {
+                    if (!isdigit((unsigned char)d)) return "bad array subscript";
+                    n = n * 10 + (d - '0');
+                }
+                if (index.empty()) return "bad array subscript";
+                if (n < pipe_status.size()) value = std::to_string(pipe_status[n]);
+            }
+            return nullptr;
+        }
+        if (body.size() > 1 && body[0] == '#') {
+            std::string v;
+            if (!valid_name(body.substr(1)) && !isdigit((unsigned char)body[1])) return "bad substitution";
+            lookup_param(body.substr(1), v);
+            value = std::to_string(v.size());
+            return nullptr;
+        }
+        size_t n = 0;
+        if (!body.empty() && is_name_start(body[0])) {
+            while (n < body.size() && is_name_char(body[n])) ++n;
+        } else if (!body.empty() && isdigit((unsigned char)body[0])) {
+            while (n < body.size() && isdigit((unsigned char)body[n])) ++n;
+        } else if (!body.empty() && strchr("?$!#@*", body[0])) {
+            n = 1;
+        }
+        if (n == 0) return "bad substitution";
+        std::string_view name = body.substr(0, n), op = body.substr(n);
+        bool set = lookup_param(name, value);
+        if (op.empty()) return nullptr;
+        bool colon = op[0] == ':';
+        if (colon) op.remove_prefix(1);
+        if (op.empty() || !strchr("-+=", op[0])) return "bad substitution";
+        bool present = set && !(colon && value.empty());
+        char kind = op[0];
+        std::string_view word = op.substr(1);
+        bool use_word = kind == '+' ? present : !present;
+        if (!use_word) {
+            if (kind == '+') value.clear();
+            return nullptr;
+        }
+        std::vector<std::string> w;
+        if (const char *err = expand_word(word, w, false)) return err;
+        value = w.empty() ? std::string() : w[0];
+        if (kind == '=') {
+            if (!is_name_start(name[0])) return "cannot assign in this way";
+            var_set(std::string(name), value);
+        }
+        return nullptr;
+    }
+    size_t n = 0;
+    if (p < raw.size() && is_name_start(raw[p])) {
+        while (p + n < raw.size() && is_name_char(raw[p + n])) ++n;
+    } else if (p < raw.size() && (isdigit((unsigned char)raw[p]) || strchr("?$!#@*", raw[p]))) {
+        n = 1;
+    }
+    if (n == 0) {
+        // A lone '$' is an ordinary character
+        literal = true;
+        i = p;
+        return nullptr;
+    }
+    if (!lookup_param(raw.substr(p, n), value)) value.clear();
+    i = p + n;
+    return nullptr;
+}
+
+static void append(std::string &s, std::string &origin, std::string_view text, char from) {
+    s.append(text.data(), text.size());
+    origin.append(text.size(), from);
+}
+
+// Globs one field if an unquoted character in it is a pattern character;
+// a pattern that matches nothing is kept as written.
+static void glob_field(const std::string &s, const std::string &origin, std::vector<std::string> &fields) {
+    bool pattern = false;
+    std::string pat;
+    for (size_t k = 0; k < s.size(); ++k) {
+        bool quoted = origin[k] == FromQuote || (origin[k] == FromExpansion && s[k] == '\\');
+        if (quoted && strchr("*?[]\\", s[k])) pat.push_back('\\');
+        else if (!quoted && strchr("*?[", s[k])) pattern = true;
+        pat.push_back(s[k]);
+    }
+    glob_t g;
+    if (!pattern || glob(pat.c_str(), 0, nullptr, &g) != 0) {
+        if (pattern) globfree(&g);
+        fields.push_back(s);
+        return;
+    }
+    for (size_t k = 0; k < g.gl_pathc; ++k) fields.push_back(g.gl_pathv[k]);
+    globfree(&g);
+}
+
+// Expands one raw word into zero or more fields. With `split` unset (used
+// for assignment values and ${...} defaults) the result is one field and
+// no splitting or globbing happens.
+static const char *expand_word(std::string_view raw, std::vector<std::string> &fields, bool split) {
+    if (raw == "\"$@\"") {
+        for (auto &p : positional) fields.push_back(p);
+        return nullptr;
+    }
+    std::string s, origin;
+    bool quoted_any = false;
+    bool dq = false;
+    size_t i = 0;
+    if (!raw.empty() && raw[0] == '~') {
+        size_t end = raw.find('/');
+        if (end == std::string_view::npos) end = raw.size();
+        std::string user(raw.substr(1, end - 1));
+        const char *home = nullptr;
+        if (user.empty()) {
+            const std::string *h = var_get("HOME");
+            home = h ? h->c_str() : nullptr;
+        } else if (user.find_first_of("'\"\\$") == std::string::npos) {
+            if (struct passwd *pw = getpwnam(user.c_str())) home = pw->pw_dir;
+        }
+        if (home) {
+            append(s, origin, home, FromQuote);
+            i = end;
+        }
+    }
+    while (i < raw.size()) {
+        char c = raw[i];
+        if (!dq && c == '\'') {
+            size_t close = raw.find('\'', i + 1);
+            append(s, origin, raw.substr(i + 1, close - i - 1), FromQuote);
+            quoted_any = true;
+            i = close + 1;
+        } else if (c == '"') {
+            dq = !dq;
+            quoted_any = true;
+            ++i;
+        } else if (c == '\\' && i + 1 < raw.size()) {
+            char next = raw[i + 1];
+            if (dq && !strchr("$`\"\\\n", next)) append(s, origin, "\\", FromQuote);
+            append(s, origin, std::string_view(&raw[i + 1], 1), FromQuote);
+            i += 2;
+        } else if (c == '$') {
+            std::string value;
+            bool literal;
+            if (const char *err = expand_param(raw, i, value, literal)) return err;
+            if (literal) append(s, origin, "$", dq ? FromQuote : FromText);
+            else append(s, origin, value, dq ? FromQuote : FromExpansion);
+        } else if (c == '`') {
+            std::string value;
+            backquote_subst(raw, i, value);
+            append(s, origin, value, dq ? FromQuote : FromExpansion);
+        } else {
+            append(s, origin, std::string_view(&raw[i], 1), dq ? FromQuote : FromText);
+            ++i;
+        }
+    }
+    if (!split) {
+        fields.push_back(s);
+        return nullptr;
+    }
+    // Field splitting: IFS characters produced by an unquoted expansion
+    // separate fields; runs of them count as one separator.
+    const std::string *ifs_var = var_get("IFS");
+    std::string ifs = ifs_var ? *ifs_var : " \t\n";
+    size_t before = fields.size();
+    std::string f, forigin;
+    for (size_t k = 0; k < s.size(); ++k) {
+        if (origin[k] == FromExpansion && ifs.find(s[k]) != std::string::npos) {
+            if (!f.empty()) glob_field(f, forigin, fields);
+            f.clear();
+            forigin.clear();
+            continue;
+        }
+        f.push_back(s[k]);
+        forigin.push_back(origin[k]);
+    }
+    if (!f.empty() || (quoted_any && fields.size() == before)) glob_field(f, forigin, fields);
+    return nullptr;
+}
+
+// A here-document body with an unquoted delimiter: parameters and command
+// substitutions are expanded and a backslash escapes only $, `, \ and newline. Quotes are
+// ordinary characters and nothing is split or globbed.
+static const char *expand_heredoc(std::string_view body, std::string &out) {
+    out.clear();
+    for (size_t i = 0; i < body.size(); ) {
+        char c = body[i];
+        if (c == '\\' && i + 1 < body.size() && strchr("$`\\\n", body[i + 1])) {
+            if (body[i + 1] != '\n') out += body[i + 1];
+            i += 2;
+        } else if (c == '$') {
+            std::string value;
+            bool literal;
+            if (const char *err = expand_param(body, i, value, literal)) return err;
+            out += literal ? std::string("$") : value;
+        } else if (c == '`') {
+            std::string value;
+            backquote_subst(body, i, value);
+            out += value;
+        } else {
+            out += c;
+            ++i;
+        }
+    }
+    return nullptr;
+}
+
+static bool start_procsub(const char *text, bool writes, Arena &arena, int &fd);
+
+static bool raw_redirects(const Command &c) {
+    for (int r = 0; r < c.nredirs; ++r) if (c.redirs[r].raw) return true;
+    return false;
+}
+
+// Produces the runnable form of `in`: raw words are expanded into fresh
+// arena arrays, commands without any are shared as they are. Process
+// substitutions are started here and become /dev/fd paths. Prints the
+// error and returns false when a word cannot be expanded.
+
+bool expand_pipeline(const Pipeline &in, Arena &arena, Pipeline &out) {
+    out = in;
+    bool any = false;
+    for (size_t k = 0; k < in.count; ++k) {
+        const Command &c = in.commands[k];
+        any |= c.raw || c.raw_assigns || raw_redirects(c);
+    }
+    if (!any) return true;
+    // Not static: a $(...) or <(...) in a word expands a pipeline of its
+    // own while this one is still collecting words.
+    std::vector<std::string> fields;
+    std::vector<char*> words;
+    std::vector<int> pass;
+    auto fail = [](const char *word, const char *err) {
+        std::cerr << word << ": " << err << "\n";
+        return false;
+    };
+    auto procsub = [&](const char *text, unsigned char kind, char *&path) {
+        int fd;
+        if (!start_procsub(text, kind == RawProcOut, arena, fd)) return false;
+        path = arena.copy("/dev/fd/" + std::to_string(fd));
+        pass.push_back(fd);
+        return true;
+    };
+    Command *cmds = arena.make_array<Command>(in.count);
+    for (size_t k = 0; k < in.count; ++k) {
+        Command c = in.commands[k];
+        if (c.raw) {
+            if (c.raw[0]) c.exec_path = nullptr;
+            words.clear();
+            pass.clear();
+            for (int w = 0; w < c.argc; ++w) {
+                if (!c.raw[w]) { words.push_back(c.argv[w]); continue; }
+                if (c.raw[w] >= RawProcIn) {
+                    char *path;
+                    if (!procsub(c.argv[w], c.raw[w], path)) return false;
+                    words.push_back(path);
+                    continue;
+                }
+                fields.clear();
+                if (const char *err = expand_word(c.argv[w], fields, true)) return fail(c.argv[w], err);
+                for (auto &f : fields) words.push_back(arena.copy(f));
+            }
+            c.argc = static_cast<int>(words.size());
+            c.argv = arena.make_array<char*>(words.size() + 1);
+            std::copy(words.begin(), words.end(), c.argv);
+            c.raw = nullptr;
+            if (!pass.empty()) {
+                int *fds = arena.make_array<int>(pass.size());
+                std::copy(pass.begin(), pass.end(), fds);
+                c.pass_fds = fds;
+                c.npass = static_cast<int>(pass.size());
+            }
+        }
+        // Assignment-only commands run in the shell; assign_vars() expands
+        // their words in order.
+        bool assigns_only = in.count == 1 && c.argc == 0 && !in.background && !in.limits && !in.place;
+        if (c.raw_assigns && !assigns_only) {
+            char **assigns = arena.make_array<char*>(c.nassigns + 1);
+            for (int a = 0; a < c.nassigns; ++a) {
+                assigns[a] = c.assigns[a];
+                if (!c.raw_assigns[a]) continue;
+                const char *eq = strchr(c.assigns[a], '=');
+                fields.clear();
+                if (const char *err = expand_word(eq + 1, fields, false)) return fail(c.assigns[a], err);
+                assigns[a] = arena.copy(std::string(c.assigns[a], eq + 1 - c.assigns[a]) + fields[0]);
+            }
+            c.assigns = assigns;
+            c.raw_assigns = nullptr;
+        }
+        if (raw_redirects(c)) {
+            Redirect *rs = arena.make_array<Redirect>(c.nredirs);
+            std::copy(c.redirs, c.redirs + c.nredirs, rs);
+            for (int n = 0; n < c.nredirs; ++n) {
+                Redirect &r = rs[n];
+                if (!r.raw) continue;
+                std::string text;
+                fields.clear();
+                if (r.kind == Redirect::Here) {
+                    if (r.raw == HereWord) {
+                        if (const char *err = expand_word(r.word, fields, false)) return fail(r.word, err);
+                        text = fields[0] + "\n";
+                    } else if (const char *err = expand_heredoc(r.word, text)) {
+                        return fail("here-document", err);
+                    }
+                    r.word = arena.copy(text);
+                } else if (r.raw >= RawProcIn) {
+                    // The shell opens a redirection (or its child does, before
+                    // it drops inherited fds), so the pipe needn't be passed on
+                    char *path;
+                    if (!procsub(r.word, r.raw, path)) return false;
+                    r.word = path;
+                } else {
+                    if (const char *err = expand_word(r.word, fields, true)) return fail(r.word, err);
+                    if (fields.size() != 1) return fail(r.word, "ambiguous redirect");
+                    if (r.kind == Redirect::Open) {
+                        r.word = arena.copy(fields[0]);
+                    } else if (fields[0] == "-") {
+                        r.kind = Redirect::Close;
+                    } else if (!fields[0].empty() && fields[0].size() <= 4 &&
+                               fields[0].find_first_not_of("0123456789") == std::string::npos) {
+                        r.src = atoi(fields[0].c_str());
+                    } else {
+                        return fail(r.word, "bad file descriptor in redirection");
+                    }
+                }
+                r.raw = 0;
+            }
+            c.redirs = rs;
+        }
+        cmds[k] = c;
+    }
+    out.commands = cmds;
+    return true;
+}
+
+// ---------- Directory cache ----------
+// Listings for completion and the PATH command index. A listing is reused
+// while the directory's device, inode and mtime are unchanged, so TAB in a
+// directory with 100k entries reads it once. Names are kept sorted: a prefix
+// is a lower_bound plus a forward scan, which is what a trie lookup would
+// buy here without the per-node allocations.
+struct DirListing {
+    dev_t dev = 0;
+    ino_t ino = 0;
+    struct timespec mtime = {0, 0};
+    bool trusted = false;
+    uint64_t version = 0;             // bumped on every re-read
+    std::vector<std::string> names;
+};
+
+static std::unordered_map<std::string, DirListing> dir_cache;
+
+#ifndef SHELL_NO_READLINE      // the listings serve completion only
+// Cached listing of `dir`, re-read when it changed; nullptr if unreadable.
+static const DirListing *list_dir(const std::string &dir) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) return nullptr;
+    DirListing &l = dir_cache[dir];
+    if (l.trusted && l.dev == st.st_dev && l.ino == st.st_ino &&
+        l.mtime.tv_sec == st.st_mtim.tv_sec && l.mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return &l;
+    DIR *d = opendir(dir.c_str());
+    if (!d) { dir_cache.erase(dir); return nullptr; }
+    l.names.clear();
+    while (struct dirent *e = readdir(d)) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        l.names.emplace_back(e->d_name);
+    }
+    closedir(d);
+    std::sort(l.names.begin(), l.names.end());
+    l.dev = st.st_dev;
+    l.ino = st.st_ino;
+    l.mtime = st.st_mtim;
+    l.version++;
+    // A directory changed within the last second may change again without
+    // its mtime moving on a coarse clock; such a listing is only used once.
+    l.trusted = st.st_mtim.tv_sec < time(nullptr) - 1;
+    return &l;
+}
+#endif
+
+// Every name in the PATH directories, first directory winning, as one
+// sorted vector. Rebuilt only when PATH or one of its listings changed.
+struct CommandIndex {
+    std::string path;
+    std::vector<std::string> dirs;
+    std::vector<uint64_t> versions;
+    std::vector<std::pair<std::string, uint32_t>> entries;   // name, index into dirs
+};
+
+static CommandIndex command_index;
+
+#ifndef SHELL_NO_READLINE
+static void command_index_refresh() {
+    const char *p = getenv("PATH");
+    std::string path = p ? p : "";
+    std::vector<std::string> dirs;
+    for (size_t pos = 0; pos <= path.size(); ) {
+        size_t colon = path.find(':', pos);
+        if (colon == std::string::npos) colon = path.size();
+        std::string dir = path.substr(pos, colon - pos);
+        dirs.push_back(dir.empty() ? "." : dir);
+        pos = colon + 1;
+    }
+    std::vector<const DirListing*> lists;
+    std::vector<uint64_t> versions;
+    for (auto &d : dirs) {
+        lists.push_back(list_dir(d));
+        versions.push_back(lists.back() ? lists.back()->version : 0);
+    }
+    if (path == command_index.path && versions == command_index.versions && !command_index.dirs.empty()) return;
+
+    command_index.path = path;
+    command_index.dirs = dirs;
+    command_index.versions = versions;
+    command_index.entries.clear();
+    for (uint32_t i = 0; i < lists.size(); ++i)
+        if (lists[i]) for (auto &n : lists[i]->names) command_index.entries.push_back({n, i});
+    // stable: among equal names the earlier PATH directory stays first
+    std::stable_sort(command_index.entries.begin(), command_index.entries.end(),
+                     [](const auto &a, const auto &b) { return a.first < b.first; });
+    auto last = std::unique(command_index.entries.begin(), command_index.entries.end(),
+                            [](const auto &a, const auto &b) { return a.first == b.first; });
+    command_index.entries.erase(last, command_index.entries.end());
+}
+#endif
+
+// A command-index answer for `name`, if the index was built under the
+// current PATH and the candidate is still an executable file.
+static bool command_index_lookup(const std::string &name, std::string &out) {
+    const char *p = getenv("PATH");
+    if (command_index.dirs.empty() || command_index.path != (p ? p : "")) return false;
+    auto &v = command_index.entries;
+    auto it = std::lower_bound(v.begin(), v.end(), name,
+                               [](const auto &e, const std::string &n) { return e.first < n; });
+    if (it == v.end() || it->first != name) return false;
+    std::string cand = command_index.dirs[it->second] + "/" + name;
+    struct stat st;
+    if (stat(cand.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || access(cand.c_str(), X_OK) != 0) return false;
+    out = cand;
+    return true;
+}
+
+// ---------- Command hash ----------
+// Resolved PATH lookups, like bash's `hash`: a hit lets the stage execve the
+// absolute path directly instead of failing through every PATH directory.
+struct HashEntry {
+    std::string path;
+    int hits;
+};
+
+static std::unordered_map<std::string, HashEntry> exec_hash;
+static std::string exec_hash_path;   // PATH the table was filled under
+static uint64_t exec_hash_generation = 0;   // bumped whenever an entry goes away
+
+static void exec_hash_sync_path() {
+    const std::string *p = var_get("PATH");
+    if (exec_hash_path != (p ? *p : "")) {
+        exec_hash.clear();
+        ++exec_hash_generation;
+        exec_hash_path = p ? *p : "";
+    }
+}
+
+static bool search_path(const std::string &path, const std::string &name, std::string &out) {
+    size_t pos = 0;
+    while (pos <= path.size()) {
+        size_t colon = path.find(':', pos);
+        if (colon == std::string::npos) colon = path.size();
+        std::string dir = path.substr(pos, colon - pos);
+        std::string cand = (dir.empty() ? "." : dir) + "/" + name;
+        struct stat st;
+        if (stat(cand.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(cand.c_str(), X_OK) == 0) {
+            out = cand;
+            return true;
+        }
+        pos = colon + 1;
+    }
+    return false;
+}
+
+// Resolves argv[0] to an executable path. `cached` tells the caller whether the
+// answer came from the table, i.e. whether a failed exec may be a stale entry.
+// Answers through relative PATH entries (".", empty) change with the working
+// directory and are never kept.
+bool resolve_command(const std::string &name, std::string &out, bool *cached = nullptr) {
+    if (cached) *cached = false;
+    if (name.find('/') != std::string::npos) { out = name; return true; }
+    exec_hash_sync_path();
+    auto it = exec_hash.find(name);
+    if (it != exec_hash.end()) {
+        it->second.hits++;
+        out = it->second.path;
+        if (cached) *cached = true;
+        return true;
+    }
+    // The completion index already knows where PATH names live; fall back
+    // to walking PATH when it hasn't been built or doesn't have the name.
+    if (!command_index_lookup(name, out) && !search_path(exec_hash_path, name, out)) return false;
+    if (out[0] == '/') exec_hash[name] = HashEntry{out, 1};
+    return true;
+}
+
+void forget_command(const std::string &name) {
+    exec_hash.erase(name);
+    ++exec_hash_generation;
+}
+
+// The value of a PATH=... prefix assignment on `cmd`, or nullptr.
+static const char *assigned_path(const Command &cmd) {
+    const char *path = nullptr;
+    for (int a = 0; a < cmd.nassigns; ++a)
+        if (strncmp(cmd.assigns[a], "PATH=", 5) == 0) path = cmd.assigns[a] + 5;
+    return path;
+}
+
+// The stage's executable: the path its cached line was compiled with, or
+// a lookup. `cached` as for resolve_command(). A PATH=... prefix is
+// searched directly; the table only knows the shell's PATH.
+static bool stage_command_path(const Command &cmd, std::string &out, bool &cached) {
+    if (const char *path = assigned_path(cmd)) {
+        cached = false;
+        if (strchr(cmd.argv[0], '/')) { out = cmd.argv[0]; return true; }
+        return search_path(path, cmd.argv[0], out);
+    }
+    if (cmd.exec_path) {
+        out = cmd.exec_path;
+        cached = true;
+        return true;
+    }
+    return resolve_command(cmd.argv[0], out, &cached);
+}
+
+// Errors after which a cached path is worth one fresh PATH walk.
+static bool is_stale_exec_error(int err) {
+    return err == ENOENT || err == ESTALE || err == ENOTDIR || err == EACCES;
+}
+
+void builtin_hash(int argc, char **argv) {
+    exec_hash_sync_path();
+    if (argc >= 2 && strcmp(argv[1], "-r") == 0) {
+        exec_hash.clear();
+        ++exec_hash_generation;
+        dir_cache.clear();
+        command_index = CommandIndex();
+        return;
+    }
+    if (argc >= 2) {
+        for (int i = 1; i < argc; ++i) {
+            std::string name = argv[i], path;
+            forget_command(name);
+            if (!resolve_command(name, path)) std::cerr << "hash: " << name << ": not found\n";
+            else if (name.find('/') == std::string::npos) exec_hash[name].hits = 0;
+        }
+        return;
+    }
+    if (exec_hash.empty()) { std::cout << "hash: hash table empty\n"; return; }
+    std::vector<std::pair<std::string, HashEntry>> rows(exec_hash.begin(), exec_hash.end());
+    std::sort(rows.begin(), rows.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    std::cout << "hits\tcommand\n";
+    for (auto &r : rows) std::cout << "   " << r.second.hits << "\t" << r.second.path << "\n";
+}
+
+// ---------- Prompt ----------
+// The prompt is assembled from cached pieces: the user once at startup, the
+// cwd whenever `cd` succeeds, last status and job count from shell state.
+// The git branch means walking up the tree and reading files, which can
+// stall on slow or network file systems, so a worker thread looks it up. The
+// prompt waits for it at most prompt_budget; a later answer wakes the poll
+// loop through the worker's eventfd and the line is redrawn with it.
+static std::string prompt_user;
+static std::string prompt_cwd;
+static std::string prompt_branch_shown;
+static const std::chrono::microseconds prompt_budget(500);
+
+struct PromptWorker {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::string want;            // directory asked for
+    uint64_t want_gen = 0;
+    uint64_t done_gen = 0;
+    std::string dir;             // directory `branch` belongs to
+    std::string branch;
+    int wake_fd = -1;
+};
+// Never destroyed: the worker thread is still blocked on it at exit.
+static PromptWorker *prompt_worker = nullptr;
+
+static void prompt_update_cwd() {
+    char *cwd = getcwd(nullptr, 0);
+    if (cwd) { prompt_cwd = cwd; free(cwd); }
+}
+
+static std::string read_small_file(const std::string &path) {
+    char buf[4096];
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return "";
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    std::string s(buf, n > 0 ? n : 0);
+    while (!s.empty() && isspace((unsigned char)s.back())) s.pop_back();
+    return s;
+}
+
+// Branch of the repository containing `dir`, read straight from HEAD rather
+// than by running git. A detached HEAD gives the abbreviated commit.
+static std::string git_branch(std::string dir) {
+    while (!dir.empty()) {
+        std::string dotgit = dir + (dir == "/" ? "" : "/") + ".git";
+        struct stat st;
+        if (stat(dotgit.c_str(), &st) == 0) {
+            std::string gitdir = dotgit;
+            if (S_ISREG(st.st_mode)) {       // worktrees and submodules: "gitdir: path"
+                std::string link = read_small_file(dotgit);
+                if (link.compare(0, 8, "gitdir: ") != 0) return "";
+                gitdir = link.substr(8);
+                if (gitdir[0] != '/') gitdir = dir + "/" + gitdir;
+            }
+            std::string head = read_small_file(gitdir + "/HEAD");
+            if (head.compare(0, 16, "ref: refs/heads/") == 0) return head.substr(16);
+            if (head.compare(0, 5, "ref: ") == 0) return head.substr(5);
+            return head.substr(0, 7);
+        }
+        if (dir == "/") break;
+        size_t slash = dir.rfind('/');
+        dir = slash == 0 || slash == std::string::npos ? "/" : dir.substr(0, slash);
+    }
+    return "";
+}
+
+static void prompt_worker_main(PromptWorker *w) {
+    std::unique_lock<std::mutex> lk(w->mu);
+    while (true) {
+        w->cv.wait(lk, [w] { return w->want_gen != w->done_gen; });
+        std::string dir = w->want;
+        uint64_t gen = w->want_gen;
+        lk.unlock();
+        std::string branch = git_branch(dir);
+        lk.lock();
+        w->dir = dir;
+        w->branch = branch;
+        w->done_gen = gen;
+        w->cv.notify_all();
+        uint64_t one = 1;
+        if (write(w->wake_fd, &one, sizeof(one)) < 0) { /* already pending */ }
+    }
+}
+
+// Readable when the worker has an answer; -1 before the first prompt.
+int prompt_event_fd() {
+    return prompt_worker ? prompt_worker->wake_fd : -1;
+}
+
+// Asks the worker about `dir` and waits up to the budget. Without an answer
+// by then, the last branch seen for the same directory stands in.
+static std::string prompt_branch(const std::string &dir) {
+    if (!prompt_worker) {
+        prompt_worker = new PromptWorker;
+        prompt_worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        std::thread(prompt_worker_main, prompt_worker).detach();
+    }
+    PromptWorker &w = *prompt_worker;
+    std::unique_lock<std::mutex> lk(w.mu);
+    w.want = dir;
+    uint64_t gen = ++w.want_gen;
+    w.cv.notify_all();
+    w.cv.wait_for(lk, prompt_budget, [&] { return w.done_gen == gen; });
+    return w.dir == dir ? w.branch : std::string();
+}
+
+// Escapes are wrapped in \001..\002 so readline knows they take no columns.
+static std::string build_prompt(const std::string &branch) {
+    std::string p = "\001\033[1;36m\002[" + prompt_user + "@ultimate-shell " + prompt_cwd;
+    if (!branch.empty()) p += " \001\033[1;33m\002(" + branch + ")\001\033[1;36m\002";
+    p += "]";
+    size_t live = 0;
+    jobs.for_each([&](const Job &j) { if (j.running || j.stopped) ++live; });
+    if (live) p += " \001\033[1;35m\002" + std::to_string(live) + (live == 1 ? " job" : " jobs");
+    if (last_status != 0) p += " \001\033[1;31m\002" + std::to_string(last_status);
+    return p + "\001\033[0m\002$ ";
+}
+
+// The worker answered while the prompt is up: redraw if the branch changed.
+static void prompt_refresh() {
+    uint64_t n;
+    if (read(prompt_worker->wake_fd, &n, sizeof(n)) < 0) return;
+    std::string branch;
+    {
+        std::lock_guard<std::mutex> lk(prompt_worker->mu);
+        if (prompt_worker->dir != prompt_cwd) return;
+        branch = prompt_worker->branch;
+    }
+    if (branch == prompt_branch_shown) return;
+    prompt_branch_shown = branch;
+#ifdef SHELL_NO_READLINE
+    input_prompt = build_prompt(branch);      // shown from the next line on
+#else
+    rl_set_prompt(build_prompt(branch).c_str());
+    rl_forced_update_display();
+#endif
+}
+
+// Puts the main prompt back with the current job count and status.
+static void prompt_redraw() {
+#ifdef SHELL_NO_READLINE
+    input_prompt = build_prompt(prompt_branch_shown);
+#else
+    rl_set_prompt(build_prompt(prompt_branch_shown).c_str());
+#endif
+    redraw_input_line();
+}
+
+// ---------- Utility builtins ----------
+// echo, printf, pwd, true, false and test/[ run in the shell: in scripts
+// they are most of what gets launched, and none of them needs a process.
+// Each returns its exit status; output goes through std::cout.
+static bool is_utility_name(std::string_view s) {
+    return s == "echo" || s == "printf" || s == "pwd" || s == "true" || s == "false" ||
+           s == "test" || s == "[";
+}
+
+// Backslash escapes as echo -e, printf formats and %b take them; \c sets
+// `stop`, after which nothing more is printed.
+static std::string expand_escapes(std::string_view s, bool &stop) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] != '\\' || i + 1 == s.size()) { out += s[i]; continue; }
+        char c = s[++i];
+        switch (c) {
+        case 'a': out += '\a'; break;
+        case 'b': out += '\b'; break;
+        case 'e': out += '\033'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'v': out += '\v'; break;
+        case '\\': out += '\\'; break;
+        case 'c': stop = true; return out;
+        case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': {
+            // \0NNN (echo) and \NNN (printf): up to three octal digits
+            size_t start = i + (c == '0' ? 1 : 0), end = start;
+            int v = 0;
+            while (end < s.size() && end < start + 3 && s[end] >= '0' && s[end] <= '7') v = v * 8 + (s[end++] - '0');
+            out += static_cast<char>(v);
+            i = end - 1;
+            break;
+        }
+        case 'x': {
+            int v = 0;
+            size_t end = i + 1;
+            while (end < s.size() && end < i + 3 && isxdigit((unsigned char)s[end]))
+                v = v * 16 + (isdigit((unsigned char)s[end]) ? s[end] - '0' : (tolower(s[end]) - 'a' + 10)), ++end;
+            if (end == i + 1) { out += "\\x"; break; }
+            out += static_cast<char>(v);
+            i = end - 1;
+            break;
+        }
+        default: out += '\\'; out += c; break;
+        }
+    }
+    return out;
+}
+
+static int builtin_echo(int argc, char **argv) {
+    bool newline = true, escapes = false;
+    int i = 1;
+    // Like bash: only words made entirely of n, e and E are options.
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+        const char *f = argv[i] + 1;
+        if (strspn(f, "neE") != strlen(f)) break;
+        for (; *f; ++f) {
+            if (*f == 'n') newline = false;
+            else escapes = *f == 'e';
+        }
+    }
+    std::string out;
+    bool stop = false;
+    for (int first = i; i < argc && !stop; ++i) {
+        if (i > first) out += ' ';
+        out += escapes ? expand_escapes(argv[i], stop) : std::string(argv[i]);
+    }
+    if (newline && !stop) out += '\n';
+    std::cout << out;
+    return 0;
+}
+
+static int builtin_pwd() {
+    char *cwd = getcwd(nullptr, 0);
+    if (!cwd) { safe_perror("pwd"); return 1; }
+    std::cout << cwd << "\n";
+    free(cwd);
+    return 0;
+}
+
+// Numeric printf arguments: decimal, 0x hex, leading-0 octal, or 'c / "c
+// for a character code. Bad input is reported and counts as far as it parsed.
+static bool printf_number(const char *arg, long long &v) {
+    if (arg[0] == '\'' || arg[0] == '"') { v = static_cast<unsigned char>(arg[1]); return true; }
+    char *end;
+    errno = 0;
+    v = strtoll(arg, &end, 0);
+    if (*arg && *end == '\0' && errno == 0) return true;
+    std::cerr << "printf: " << arg << ": invalid number\n";
+    return false;
+}
+
+static int builtin_printf(int argc, char **argv) {
+    if (argc < 2) { std::cerr << "printf: usage: printf format [arguments]\n"; return 2; }
+    std::string_view fmt = argv[1];
+    int next = 2, status = 0;
+    std::string out;
+    bool stop = false;
+    // The format is reused while arguments remain, as POSIX specifies.
+    do {
+        int first = next;
+        for (size_t i = 0; i < fmt.size() && !stop; ++i) {
+            if (fmt[i] == '\\') {
+                size_t j = i + 1;
+                if (j < fmt.size() && fmt[j] >= '0' && fmt[j] <= '7') {
+                    while (j < fmt.size() && j < i + 4 && fmt[j] >= '0' && fmt[j] <= '7') ++j;
+                } else if (j < fmt.size() && fmt[j] == 'x') {
+                    ++j;
+                    while (j < fmt.size() && j < i + 4 && isxdigit((unsigned char)fmt[j])) ++j;
+                } else {
+                    j = std::min(j + 1, fmt.size());
+                }
+                out += expand_escapes(fmt.substr(i, j - i), stop);
+                i = j - 1;
+                continue;
+            }
+            if (fmt[i] != '%') { out += fmt[i]; continue; }
+            if (i + 1 < fmt.size() && fmt[i + 1] == '%') { out += '%'; ++i; continue; }
+
+            std::string spec = "%";
+            size_t j = i + 1;
+            while (j < fmt.size() && strchr("-+ #0", fmt[j])) spec += fmt[j++];
+            for (int part = 0; part < 2; ++part) {
+                if (part == 1) {
+                    if (j >= fmt.size() || fmt[j] != '.') break;
+                    spec += fmt[j++];
+                }
+                if (j < fmt.size() && fmt[j] == '*') {
+                    long long n = 0;
+                    if (next < argc && !printf_number(argv[next++], n)) status = 1;
+                    spec += std::to_string(n);
+                    ++j;
+                } else {
+                    while (j < fmt.size() && isdigit((unsigned char)fmt[j])) spec += fmt[j++];
+                }
+            }
+            while (j < fmt.size() && strchr("hlLqjzt", fmt[j])) ++j;
+            if (j >= fmt.size()) { std::cerr << "printf: missing conversion\n"; return 1; }
+            char conv = fmt[j];
+            i = j;
+            const char *arg = next < argc ? argv[next++] : nullptr;
+            char buf[512];
+            std::string piece;
+            switch (conv) {
+            case 'd': case 'i': {
+                long long v = 0;
+                if (arg && !printf_number(arg, v)) status = 1;
+                snprintf(buf, sizeof(buf), (spec + "lld").c_str(), v);
+                piece = buf;
+                break;
+            }
+            case 'u': case 'o': case 'x': case 'X': {
+                long long v = 0;
+                if (arg && !printf_number(arg, v)) status = 1;
+                snprintf(buf, sizeof(buf), (spec + "ll" + conv).c_str(), static_cast<unsigned long long>(v));
+                piece = buf;
+                break;
+            }
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+                double v = 0;
+                if (arg) {
+                    char *end;
+                    v = strtod(arg, &end);
+                    if (*end) { std::cerr << "printf: " << arg << ": invalid number\n"; status = 1; }
+                }
+                snprintf(buf, sizeof(buf), (spec + conv).c_str(), v);
+                piece = buf;
+                break;
+            }
+            case 'c':
+                snprintf(buf, sizeof(buf), (spec + "c").c_str(), arg && *arg ? arg[0] : '\0');
+                piece.assign(buf, arg && *arg ? strlen(buf) : std::max<size_t>(strlen(buf), 1));
+                break;
+            case 's': case 'b': {
+                std::string text = arg ? arg : "";
+                if (conv == 'b') text = expand_escapes(text, stop);
+                int need = snprintf(nullptr, 0, (spec + "s").c_str(), text.c_str());
+                piece.resize(need + 1);
+                snprintf(&piece[0], piece.size(), (spec + "s").c_str(), text.c_str());
+                piece.resize(need);
+                break;
+            }
+            default:
+                std::cerr << "printf: %" << conv << ": invalid conversion\n";
+                return 1;
+            }
+            out += piece;
+        }
+        if (next == first) break;     // the format takes no arguments
+    } while (next < argc && !stop);
+    std::cout << out;
+    return status;
+}
+
+// test / [ : a recursive-descent evaluator over the words, with the usual
+// precedence ! > -a > -o and parentheses. Errors give status 2.
+struct TestEval {
+    char **args;
+    int n, pos = 0;
+    bool error = false;
+
+    bool fail(const std::string &msg) {
+        if (!error) std::cerr << "test: " << msg << "\n";
+        error = true;
+        return false;
+    }
+    bool more() const { return pos < n; }
+    std::string_view peek(int ahead = 0) const { return pos + ahead < n ? args[pos + ahead] : ""; }
+
+    bool integer(std::string_view s, long long &v) {
+        std::string str(s);
+        char *end;
+        errno = 0;
+        v = strtoll(str.c_str(), &end, 10);
+        if (str.empty() || *end || errno) return fail(str + ": integer expression expected");
+        return true;
+    }
+
+    static bool is_unary(std::string_view op) {
+        return op.size() == 2 && op[0] == '-' && strchr("bcdefghLknprsSuwxzO", op[1]);
+    }
+    static bool is_binary(std::string_view op) {
+        return op == "=" || op == "==" || op == "!=" || op == "<" || op == ">" ||
+               op == "-eq" || op == "-ne" || op == "-lt" || op == "-le" || op == "-gt" ||
+               op == "-ge" || op == "-nt" || op == "-ot" || op == "-ef";
+    }
+
+    bool unary(std::string_view op, const char *arg) {
+        struct stat st;
+        char f = op[1];
+        if (f == 'n') return *arg != '\0';
+        if (f == 'z') return *arg == '\0';
+        if (f == 'r') return access(arg, R_OK) == 0;
+        if (f == 'w') return access(arg, W_OK) == 0;
+        if (f == 'x') return access(arg, X_OK) == 0;
+        if (f == 'L' || f == 'h') return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        if (f == 't') { long long fd; return integer(arg, fd) && isatty(static_cast<int>(fd)); }
+        if (stat(arg, &st) != 0) return false;
+        switch (f) {
+        case 'e': return true;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'g': return st.st_mode & S_ISGID;
+        case 'u': return st.st_mode & S_ISUID;
+        case 'k': return st.st_mode & S_ISVTX;
+        case 'O': return st.st_uid == geteuid();
+        }
+        return false;
+    }
+
+    bool binary(const char *a, std::string_view op, const char *b) {
+        if (op == "=" || op == "==") return strcmp(a, b) == 0;
+        if (op == "!=") return strcmp(a, b) != 0;
+        if (op == "<") return strcmp(a, b) < 0;
+        if (op == ">") return strcmp(a, b) > 0;
+        if (op == "-nt" || op == "-ot" || op == "-ef") {
+            struct stat sa, sb;
+            bool ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+            if (op == "-ef") return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+            auto newer = [](const struct stat &x, const struct stat &y) {
+                return x.st_mtim.tv_sec != y.st_mtim.tv_sec ? x.st_mtim.tv_sec > y.st_mtim.tv_sec
+                                                            : x.st_mtim.tv_nsec > y.st_mtim.tv_nsec;
+            };
+            if (op == "-nt") return ha && (!hb || newer(sa, sb));
+            return hb && (!ha || newer(sb, sa));
+        }
+        long long x, y;
+        if (!integer(a, x) || !integer(b, y)) return false;
+        if (op == "-eq") return x == y;
+        if (op == "-ne") return x != y;
+        if (op == "-lt") return x < y;
+        if (op == "-le") return x <= y;
+        if (op == "-gt") return x > y;
+        return x >= y;
+    }
+
+    bool primary() {
+        if (!more()) return fail("argument expected");
+        // A binary operator after the next word wins over other readings,
+        // so `[ -n = -n ]` and `[ ! = x ]` compare strings.
+        if (n - pos >= 3 && is_binary(peek(1))) {
+            const char *a = args[pos], *b = args[pos + 2];
+            std::string_view op = peek(1);
+            pos += 3;
+            return binary(a, op, b);
+        }
+        if (peek() == "(") {
+            ++pos;
+            bool v = or_expr();
+            if (peek() != ")") return fail("')' expected");
+            ++pos;
+            return v;
+        }
+        if (n - pos >= 2 && is_unary(peek())) {
+            std::string_view op = peek();
+            const char *arg = args[pos + 1];
+            pos += 2;
+            return unary(op, arg);
+        }
+        return *args[pos++] != '\0';
+    }
+    bool not_expr() {
+        // `! x` with nothing after the operand is the negation even of a lone "!"
+        if (peek() == "!" && n - pos >= 2) { ++pos; return !not_expr(); }
+        return primary();
+    }
+    bool and_expr() {
+        bool v = not_expr();
+        while (!error && peek() == "-a") { ++pos; bool r = not_expr(); v = v && r; }
+        return v;
+    }
+    bool or_expr() {
+        bool v = and_expr();
+        while (!error && peek() == "-o") { ++pos; bool r = and_expr(); v = v || r; }
+        return v;
+    }
+};
+
+static int builtin_test(int argc, char **argv) {
+    int n = argc - 1;
+    if (strcmp(argv[0], "[") == 0) {
+        if (n == 0 || strcmp(argv[argc - 1], "]") != 0) { std::cerr << "[: missing ']'\n"; return 2; }
+        --n;
+    }
+    if (n == 0) return 1;
+    TestEval t{argv + 1, n};
+    bool v = t.or_expr();
+    if (!t.error && t.more()) t.fail(std::string(t.peek()) + ": unexpected argument");
+    if (t.error) return 2;
+    return v ? 0 : 1;
+}
+
+// ---------- Builtins ----------
+static const char *const builtin_names[] = {
+    "cd", "help", "exit", "clear", "about", "jobs", "fg", "bg", "killjob",
+    "hash", "parallel", "times", "set", "history", "wait", "export", "unset",
+    "echo", "printf", "pwd", "true", "false", "test", "[", "coproc", "coreq",
+};
+
+bool is_builtin_name(std::string_view s) {
+    for (const char *b : builtin_names)
+        if (s == b) return true;
+    return false;
+}
+
+std::string parallel_progress(const Job &j);
+void cancel_parallel(Job &j);
+void builtin_parallel(int argc, char **argv, bool background);
+void builtin_coproc(int argc, char **argv);
+void builtin_coreq(int argc, char **argv);
+void builtin_history(int argc, char **argv);
+
+void print_jobs() {
+    jobs.for_each([](const Job &j) {
+        std::cout << "[" << j.id << "] " <<
+            (j.running ? "Running" : (j.stopped ? "Stopped" : "Done")) <<
+            "\t" << j.pgid << "\t" << j.cmdline << (j.background ? " &" : "");
+        if (j.run) std::cout << "\t(" << parallel_progress(j) << ")";
+        std::cout << "\n";
+    });
+}
+
+void show_easter_egg(std::string_view cmd) {
+    if (cmd == "rhino") {
+        std::cout << "\n\033[1;31mTHUG\033[0m\n";
+        std::cout << "\033[1;36m\"He who makes others see but he himself is invisible.\"\033[0m\n\n";
+    } else if (cmd == "xsmax") {
+        std::cout << "\n\033[1;33mR€$!$T\033[0m\n";
+        std::cout << "\033[1;35m\"Can't see his own Abyss.\"\033[0m\n\n";
+    }
+}
+
+// set                     list the options
+// set pipebuf=SIZE|default  pipe buffer size for every pipeline
+// set debug | +debug     trace shell internals (e.g. pipe sizes) on stderr
+// set telemetry=FILE|unix:SOCKET|off  send a JSON line per job start and exit
+// set notify=immediate|batch|summary|off[:MS]  how background job ends are shown
+void builtin_set(int argc, char **argv) {
+    static const char *const notify_modes[] = {"immediate", "batch", "summary", "off"};
+    if (argc == 1) {
+        std::cout << "pipebuf=" << (opt_pipebuf ? format_size(opt_pipebuf) : "default") << "\n"
+                  << "debug=" << (opt_debug ? "on" : "off") << "\n"
+                  << "pipefail=" << (opt_pipefail ? "on" : "off") << "\n"
+                  << "telemetry=" << (telemetry ? telemetry->target : "off") << "\n"
+                  << "notify=" << notify_modes[static_cast<int>(opt_notify)] << ":" << opt_notify_ms << "\n";
+        return;
+    }
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        bool off = !arg.empty() && arg[0] == '+';
+        if (off) arg.remove_prefix(1);
+        // POSIX spelling: set -o NAME / set +o NAME
+        if ((arg == "o" && off) || (!off && arg == "-o")) {
+            if (++i == argc) { std::cerr << "set: -o needs an option name\n"; return; }
+            arg = argv[i];
+        }
+        size_t eq = arg.find('=');
+        std::string_view name = arg.substr(0, eq);
+        std::string_view value = eq == std::string_view::npos ? std::string_view() : arg.substr(eq + 1);
+        if (name == "pipebuf") {
+            size_t n = 0;
+            if (off || value == "default") opt_pipebuf = 0;
+            else if (parse_size(value, n)) opt_pipebuf = n;
+            else std::cerr << "set: pipebuf: invalid size '" << value << "'\n";
+        } else if (name == "debug" || name == "pipefail") {
+            bool &opt = name == "debug" ? opt_debug : opt_pipefail;
+            if (eq == std::string_view::npos) opt = !off;
+            else if (value == "on" || value == "off") opt = value == "on";
+            else std::cerr << "set: " << name << ": expected on or off\n";
+        } else if (name == "telemetry") {
+            if (off || value == "off") telemetry_close();
+            else if (value.empty()) std::cerr << "set: telemetry: expected a file, unix:SOCKET or off\n";
+            else if (!telemetry_open(std::string(value))) last_status = 1;
+        } else if (name == "notify") {
+            std::string_view mode = value.substr(0, value.find(':'));
+            std::string_view ms = mode.size() < value.size() ? value.substr(mode.size() + 1) : "";
+            auto m = std::find(std::begin(notify_modes), std::end(notify_modes), mode);
+            char *end = nullptr;
+            std::string ms_text(ms);
+            long n = ms.empty() ? opt_notify_ms : strtol(ms_text.c_str(), &end, 10);
+            if (off) {
+                opt_notify = NotifyMode::Off;
+            } else if (m == std::end(notify_modes) || n < 0 || n > 60000 || (end && *end)) {
+                std::cerr << "set: notify: expected immediate, batch, summary or off, optionally :MS\n";
+                last_status = 1;
+            } else {
+                opt_notify = static_cast<NotifyMode>(m - std::begin(notify_modes));
+                opt_notify_ms = static_cast<int>(n);
+            }
+        } else {
+            std::cerr << "set: unknown option: " << name << "\n";
+        }
+    }
+}
+
+// export [NAME[=value]...]: marks variables for the environment of started
+// commands; with no names it lists the exported ones.
+void builtin_export(int argc, char **argv) {
+    if (argc == 1) {
+        std::vector<std::string> names;
+        for (auto &kv : shell_vars) if (kv.second.exported) names.push_back(kv.first);
+        std::sort(names.begin(), names.end());
+        for (auto &n : names) std::cout << "export " << n << "=\"" << *var_get(n) << "\"\n";
+        return;
+    }
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string name(arg.substr(0, eq));
+        if (!valid_name(name)) {
+            std::cerr << "export: " << arg << ": not a valid name\n";
+            last_status = 1;
+            continue;
+        }
+        const std::string *cur = var_get(name);
+        var_set(name, eq != std::string_view::npos ? std::string(arg.substr(eq + 1)) : cur ? *cur : "", true);
+    }
+}
+
+void builtin_execute(int argc, char **argv, bool background = false) {
+    if (argc == 0) return;
+    std::string_view cmd = argv[0];
+    if (cmd == "cd") {
+        const std::string *home = var_get("HOME");
+        const char *dir = argc >= 2 ? argv[1] : home ? home->c_str() : nullptr;
+        char *old = getcwd(nullptr, 0);
+        if (dir && chdir(dir) != 0) { perror("cd"); last_status = 1; }
+        prompt_update_cwd();
+        if (dir && last_status == 0) {
+            if (old) var_set("OLDPWD", old);
+            var_set("PWD", prompt_cwd);
+        }
+        free(old);
+    } else if (cmd == "help") {
+        std::cout << "mini-shell help:\nBuiltins: cd, help, clear, about, jobs, fg, bg, killjob, hash, parallel, times, set, history, wait,\n  export, unset, coproc, coreq, echo, printf, pwd, true, false, test/[, exit\nKeywords: time pipeline, PIPEBUF=size pipeline, NAME=value [command],\n  limit [--mem SIZE] [--cpu N] [--io SPEC] pipeline,\n  place [--node N] [auto | CPUS[:CPUS...]] pipeline\nLists: a; b, a && b, a || b, a & b (set -o pipefail: fail if any stage fails)\nRedirections: [N]<file [N]>file [N]>>file [N]<>file [N]>&M [N]>&- &>file &>>file <<WORD <<<word\nSubstitutions: $(command) `command` <(command) >(command)\n";
+    } else if (cmd == "clear") {
+        std::cout << "\033[H\033[2J" << std::flush;
+    } else if (cmd == "about") {
+        std::cout << "Ultimate mini-shell by Sami-style assistant.\n";
+    } else if (cmd == "jobs") {
+        print_jobs();
+    } else if (cmd == "fg") {
+        if (argc >= 2) {
+            std::string idstr = argv[1];
+            if (!idstr.empty() && idstr[0] == '%') idstr = idstr.substr(1);
+            int id = atoi(idstr.c_str());
+            Job* j = find_job_by_id(id);
+            if (!j) { std::cout << "fg: job not found\n"; return; }
+            if (j->pgid > 0 && kill(-j->pgid, SIGCONT) < 0) perror("SIGCONT");
+            j->background = false; j->stopped = false; j->running = true;
+            for (auto &p : j->procs) p.stopped = false;
+            if (interactive) tcsetpgrp(STDIN_FILENO, j->pgid);
+            wait_for_job(*j);
+            if (interactive) tcsetpgrp(STDIN_FILENO, shell_pgid);
+            if (!j->running && !j->stopped) last_status = exit_code(j->procs.back().status);
+            else if (j->stopped) {
+                print_stopped_job(*j);
+                last_status = 128 + SIGTSTP;
+            }
+            remove_finished_jobs();
+        } else std::cout << "fg: usage: fg %jobid\n";
+    } else if (cmd == "bg") {
+        if (argc >= 2) {
+            std::string idstr = argv[1];
+            if (!idstr.empty() && idstr[0] == '%') idstr = idstr.substr(1);
+            int id = atoi(idstr.c_str());
+            Job* j = find_job_by_id(id);
+            if (!j) { std::cout << "bg: job not found\n"; return; }
+            if (j->pgid > 0 && kill(-j->pgid, SIGCONT) < 0) perror("SIGCONT");
+            j->background = true; j->stopped = false; j->running = true;
+            std::cout << "[" << j->id << "] " << j->pgid << " resumed in background\n";
+        } else std::cout << "bg: usage: bg %jobid\n";
+    } else if (cmd == "killjob") {
+        if (argc >= 2) {
+            std::string idstr = argv[1];
+            if (!idstr.empty() && idstr[0] == '%') idstr = idstr.substr(1);
+            int id = atoi(idstr.c_str());
+            Job* j = find_job_by_id(id);
+            if (!j) { std::cout << "killjob: job not found\n"; return; }
+            cancel_parallel(*j);
+            if (j->pgid > 0 && kill(-j->pgid, SIGKILL) < 0) perror("kill");
+            else std::cout << "killed job " << j->id << "\n";
+        } else std::cout << "killjob: usage: killjob %jobid\n";
+    } else if (cmd == "hash") {
+        builtin_hash(argc, argv);
+    } else if (cmd == "times") {
+        builtin_times();
+    } else if (cmd == "set") {
+        builtin_set(argc, argv);
+    } else if (cmd == "export") {
+        builtin_export(argc, argv);
+    } else if (cmd == "unset") {
+        for (int i = 1; i < argc; ++i) {
+            if (valid_name(argv[i])) var_unset(argv[i]);
+            else { std::cerr << "unset: " << argv[i] << ": not a valid name\n"; last_status = 1; }
+        }
+    } else if (cmd == "history") {
+        builtin_history(argc, argv);
+    } else if (cmd == "wait") {
+        // wait [%id]: until the job, or every background job, is done or stopped
+        std::vector<int> ids;
+        if (argc >= 2) {
+            std::string idstr = argv[1];
+            if (!idstr.empty() && idstr[0] == '%') idstr = idstr.substr(1);
+            ids.push_back(atoi(idstr.c_str()));
+            if (!find_job_by_id(ids[0])) { std::cout << "wait: job not found\n"; last_status = 127; return; }
+        } else {
+            jobs.for_each([&](const Job &j) { if (j.background && j.running) ids.push_back(j.id); });
+        }
+        for (int id : ids) {
+            Job *j = find_job_by_id(id);
+            if (!j || !j->running) continue;
+            if (!wait_for_job(*j, true)) { last_status = 128 + SIGINT; return; }
+            if (!j->running && !j->stopped) last_status = exit_code(j->procs.back().status);
+        }
+        remove_finished_jobs();
+    } else if (cmd == "parallel") {
+        builtin_parallel(argc, argv, background);
+    } else if (cmd == "coproc") {
+        builtin_coproc(argc, argv);
+    } else if (cmd == "coreq") {
+        builtin_coreq(argc, argv);
+    } else if (is_utility_name(cmd)) {
+        if (cmd == "echo") last_status = builtin_echo(argc, argv);
+        else if (cmd == "printf") last_status = builtin_printf(argc, argv);
+        else if (cmd == "pwd") last_status = builtin_pwd();
+        else if (cmd == "true") last_status = 0;
+        else if (cmd == "false") last_status = 1;
+        else last_status = builtin_test(argc, argv);
+    } else if (cmd == "exit") {
+        std::cout.flush();
+        exit(argc >= 2 ? atoi(argv[1]) & 0xff : last_status);
+    }
+    else if (cmd == "rhino" || cmd == "xsmax") show_easter_egg(cmd);
+}
+
+// The text of a here-document or here-string as a readable fd: a memfd, so
+// nothing touches the disk and no writer has to keep pace with the reader.
+// Kernels without memfd_create() (before 3.17) get a pipe grown to fit.
+static int here_fd(const char *text) {
+    size_t len = strlen(text);
+    int fd = static_cast<int>(syscall(SYS_memfd_create, "here-document", MFD_CLOEXEC));
+    int p[2] = {-1, -1};
+    if (fd < 0) {
+        if (pipe2(p, O_CLOEXEC) < 0) return -1;
+        if (len > 65536) fcntl(p[1], F_SETPIPE_SZ, static_cast<int>(len));
+        fd = p[1];
+    }
+    for (size_t off = 0; off < len; ) {
+        ssize_t w = write(fd, text + off, len - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            int err = errno;
+            close(fd);
+            if (p[0] >= 0) close(p[0]);
+            errno = err;
+            return -1;
+        }
+        off += w;
+    }
+    if (p[0] < 0) {
+        lseek(fd, 0, SEEK_SET);
+        return fd;
+    }
+    close(p[1]);
+    return p[0];
+}
+
+// The fd a redirection reads from or writes to: the opened file, or the
+// here-document text. -1, with the error reported, on failure.
+static int open_redirect(const Redirect &r) {
+    int fd = r.kind == Redirect::Here ? here_fd(r.word) : open(r.word, r.flags | O_CLOEXEC, 0644);
+    if (fd >= 0) return fd;
+    if (r.kind == Redirect::Here) safe_perror("here-document");
+    else if (r.fd == STDIN_FILENO) safe_perror("open infile");
+    else if (r.fd == STDOUT_FILENO) safe_perror("open outfile");
+    else safe_perror(r.word);
+    return -1;
+}
+
+// `N>&M` may only name an fd the commands are meant to see: one inherited
+// by the shell, or one an earlier redirection set up. The shell's own fds
+// are close-on-exec, so they don't qualify.
+static bool redirect_source_ok(int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    if (flags >= 0 && !(flags & FD_CLOEXEC)) return true;
+    std::cerr << fd << ": Bad file descriptor\n";
+    return false;
+}
+
+// Redirections of a builtin that runs inside the shell: applied to the
+// shell's own fds in order and put back, in reverse, afterwards. The saved
+// copies are close-on-exec and kept above the low fds, so a builtin that
+// starts processes (parallel) doesn't leak them.
+struct SavedStdio {
+    struct Saved { int fd, copy, flags; };   // copy -1: `fd` was closed
+    std::vector<Saved> saved;
+
+    // False, with the error reported and everything put back, when a file
+    // can't be opened or a `>&` source isn't open.
+    bool apply(const Command &cmd) {
+        if (cmd.nredirs == 0) return true;
+        std::cout.flush();
+        for (int n = 0; n < cmd.nredirs; ++n) {
+            const Redirect &r = cmd.redirs[n];
+            int src = -1;
+            if (r.kind == Redirect::Dup && !redirect_source_ok(r.src)) { restore(); return false; }
+            save(r.fd);
+            if (r.kind == Redirect::Open || r.kind == Redirect::Here) {
+                src = open_redirect(r);
+                if (src < 0) { restore(); return false; }
+                if (src == r.fd) { fcntl(src, F_SETFD, 0); continue; }
+                dup2(src, r.fd);
+                close(src);
+            } else if (r.kind == Redirect::Dup) {
+                if (r.src != r.fd) dup2(r.src, r.fd);
+            } else {
+                close(r.fd);
+            }
+        }
+        return true;
+    }
+
+    void save(int fd) {
+        for (const Saved &s : saved) if (s.fd == fd) return;
+        saved.push_back({fd, fcntl(fd, F_DUPFD_CLOEXEC, 10), fcntl(fd, F_GETFD)});
+    }
+
+    void restore() {
+        if (saved.empty()) return;
+        std::cout.flush();
+        for (auto s = saved.rbegin(); s != saved.rend(); ++s) {
+            if (s->copy < 0) { close(s->fd); continue; }
+            // One of the shell's own fds (a script being read) stays close-on-exec.
+            dup3(s->copy, s->fd, s->flags > 0 && (s->flags & FD_CLOEXEC) ? O_CLOEXEC : 0);
+            close(s->copy);
+        }
+        saved.clear();
+        // A write to a closed or full fd leaves the stream failed for good.
+        std::cout.clear();
+        std::cerr.clear();
+    }
+};
+
+#ifndef SHELL_NO_READLINE
+// ---------- Readline completion ----------
+// Command names in command position (builtins and the PATH index), paths
+// everywhere else, both from the cached listings above. At most
+// completion_limit candidates are collected, so a TAB on a huge directory
+// returns in bounded time.
+static const size_t completion_limit = 10000;
+static std::vector<std::string> completion_list;
+static size_t completion_next = 0;
+
+static char *completion_generator(const char *, int state) {
+    if (state == 0) completion_next = 0;
+    if (completion_next >= completion_list.size()) return nullptr;
+    return strdup(completion_list[completion_next++].c_str());
+}
+
+static bool in_command_position(int start) {
+    for (int i = start - 1; i >= 0; --i) {
+        char c = rl_line_buffer[i];
+        if (c == ' ' || c == '\t') continue;
+        return c == '|' || c == '&';
+    }
+    return true;
+}
+
+static void complete_command(const std::string &prefix) {
+    for (const char *b : builtin_names)
+        if (strncmp(b, prefix.c_str(), prefix.size()) == 0) completion_list.push_back(b);
+    command_index_refresh();
+    auto &v = command_index.entries;
+    auto it = std::lower_bound(v.begin(), v.end(), prefix,
+                               [](const auto &e, const std::string &p) { return e.first < p; });
+    for (; it != v.end() && it->first.compare(0, prefix.size(), prefix) == 0 &&
+           completion_list.size() < completion_limit; ++it) {
+        // Only the candidates are checked, not every file in PATH.
+        std::string full = command_index.dirs[it->second] + "/" + it->first;
+        if (access(full.c_str(), X_OK) == 0) completion_list.push_back(it->first);
+    }
+    std::sort(completion_list.begin(), completion_list.end());
+    completion_list.erase(std::unique(completion_list.begin(), completion_list.end()), completion_list.end());
+}
+
+static void complete_path(const std::string &text) {
+    size_t slash = text.rfind('/');
+    std::string shown = slash == std::string::npos ? "" : text.substr(0, slash + 1);
+    std::string base = slash == std::string::npos ? text : text.substr(slash + 1);
+    std::string dir = shown.empty() ? "." : shown;
+    if (dir[0] == '~' && (dir.size() == 1 || dir[1] == '/')) {
+        const char *home = getenv("HOME");
+        if (home) dir = home + dir.substr(1);
+    }
+    const DirListing *l = list_dir(dir);
+    if (!l) return;
+    auto it = std::lower_bound(l->names.begin(), l->names.end(), base);
+    for (; it != l->names.end() && it->compare(0, base.size(), base) == 0 &&
+           completion_list.size() < completion_limit; ++it) {
+        if ((*it)[0] == '.' && (base.empty() || base[0] != '.')) continue;
+        completion_list.push_back(shown + *it);
+    }
+}
+
+char **custom_completion(const char *text, int start, int /*end*/) {
+    rl_attempted_completion_over = 1;    // never fall back to readline's own walk
+    completion_list.clear();
+    std::string t = text;
+    bool command = in_command_position(start) && t.find('/') == std::string::npos;
+    // Lets readline quote the match and add '/' after directories.
+    rl_filename_completion_desired = command ? 0 : 1;
+    if (command) complete_command(t);
+    else complete_path(t);
+    return rl_completion_matches(text, completion_generator);
+}
+#endif // SHELL_NO_READLINE
+
+// ---------- Batch input ----------
+// Buffered reader for -c strings, script files and piped stdin; one read()
+// serves many lines instead of readline's per-character terminal handling.
+struct LineReader {
+    int fd;
+    std::vector<char> buf;
+    size_t pos = 0, len = 0;
+    bool eof = false;
+
+    explicit LineReader(int f) : fd(f), buf(1 << 16) {}
+
+    bool next(std::string &line) {
+        line.clear();
+        while (true) {
+            if (pos < len) {
+                const char *start = buf.data() + pos;
+                const char *nl = static_cast<const char*>(memchr(start, '\n', len - pos));
+                if (nl) {
+                    line.append(start, nl - start);
+                    pos += (nl - start) + 1;
+                    return true;
+                }
+                line.append(start, len - pos);
+                pos = len;
+            }
+            if (eof) return !line.empty();
+            ssize_t r = read(fd, buf.data(), buf.size());
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) { eof = true; continue; }
+            pos = 0;
+            len = static_cast<size_t>(r);
+        }
+    }
+
+    // When the script *is* our stdin, children inherit the same file offset.
+    // Hand back what we buffered but haven't run yet (if seekable), so e.g. a
+    // `cat` in the script doesn't skip ahead of the lines still to come.
+    void release_unread() {
+        if (pos < len && lseek(fd, -static_cast<off_t>(len - pos), SEEK_CUR) >= 0) pos = len = 0;
+    }
+};
+
+static LineReader *script_stdin = nullptr;
+
+// ---------- Placement ----------
+// `place` pins the stages of a pipeline before they exec: CPUs with
+// sched_setaffinity(), memory with set_mempolicy(MPOL_BIND) for --node.
+// `auto` puts all stages of the pipeline on the CPUs of one last-level
+// cache, so a pipe's reader and writer share that cache (and socket);
+// pipelines started one after another are spread over the LLCs in turn.
+// Memory then comes from the local node on first touch by default.
+static std::vector<cpu_set_t> llc_groups;   // CPU sets sharing a last-level cache
+static size_t llc_next = 0;
+
+// Reads the LLC groups from sysfs once: per CPU, the shared_cpu_list of
+// its highest-level cache.
+static const std::vector<cpu_set_t> &find_llc_groups() {
+    static bool loaded = false;
+    if (loaded) return llc_groups;
+    loaded = true;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cache";
+        if (access(dir.c_str(), F_OK) != 0) {
+            if (errno == ENOENT && access(("/sys/devices/system/cpu/cpu" + std::to_string(cpu)).c_str(), F_OK) != 0) break;
+            continue;
+        }
+        int best_level = 0;
+        std::string best;
+        for (int index = 0; ; ++index) {
+            std::string idx = dir + "/index" + std::to_string(index);
+            std::string level = read_small_file(idx + "/level");
+            if (level.empty()) break;
+            if (read_small_file(idx + "/type") == "Instruction") continue;
+            if (atoi(level.c_str()) > best_level) {
+                best_level = atoi(level.c_str());
+                best = read_small_file(idx + "/shared_cpu_list");
+            }
+        }
+        cpu_set_t set;
+        if (!parse_cpulist(best, set)) continue;
+        bool known = false;
+        for (auto &g : llc_groups) known = known || CPU_EQUAL(&g, &set);
+        if (!known) llc_groups.push_back(set);
+    }
+    return llc_groups;
+}
+
+// Works out the CPUs and memory node of every stage of a placed pipeline
+// into `sets` (one per stage) and points the stages at them. False, with
+// the reason reported, when the placement can't be met.
+static bool place_stages(const Placement &place, std::vector<Command> &stages, std::vector<cpu_set_t> &sets) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        safe_perror("place: sched_getaffinity");
+        return false;
+    }
+    if (place.node >= 0) {
+        cpu_set_t node_cpus;
+        std::string list = read_small_file("/sys/devices/system/node/node" + std::to_string(place.node) + "/cpulist");
+        if (!parse_cpulist(list, node_cpus)) {
+            std::cerr << "place: no NUMA node " << place.node << "\n";
+            return false;
+        }
+        // A memory-only node has no CPUs; its stages run wherever they may
+        if (!place.ncpus && CPU_COUNT(&node_cpus)) CPU_AND(&allowed, &allowed, &node_cpus);
+    }
+    cpu_set_t chosen = allowed;
+    if (place.automatic) {
+        const auto &groups = find_llc_groups();
+        bool found = false;
+        for (size_t n = 0; n < groups.size() && !found; ++n) {
+            cpu_set_t g;
+            CPU_AND(&g, &groups[(llc_next + n) % groups.size()], &allowed);
+            if (CPU_COUNT(&g) == 0) continue;
+            chosen = g;
+            llc_next = (llc_next + n + 1) % groups.size();
+            found = true;
+        }
+        if (opt_debug && !found) std::cerr << "+ place auto: no cache topology, stages not pinned\n";
+    }
+    sets.assign(stages.size(), chosen);
+    for (size_t k = 0; k < stages.size(); ++k) {
+        if (place.ncpus) {
+            CPU_AND(&sets[k], &place.cpus[std::min(k, place.ncpus - 1)], &allowed);
+            if (CPU_COUNT(&sets[k]) == 0) {
+                std::cerr << "place: stage " << k + 1 << ": none of its CPUs is available\n";
+                return false;
+            }
+        }
+        if (opt_debug) {
+            std::cerr << "+ place stage " << k + 1 << ": cpus";
+            for (int c = 0; c < CPU_SETSIZE; ++c) if (CPU_ISSET(c, &sets[k])) std::cerr << " " << c;
+            if (place.node >= 0) std::cerr << ", memory on node " << place.node;
+            std::cerr << "\n";
+        }
+        stages[k].cpus = &sets[k];
+        stages[k].mem_node = place.node;
+    }
+    return true;
+}
+
+// In the child, before exec: only async-signal-safe calls.
+static void apply_placement(const Command &cmd) {
+    if (cmd.cpus && sched_setaffinity(0, sizeof(cpu_set_t), cmd.cpus) < 0) child_perror("place: sched_setaffinity");
+    if (cmd.mem_node >= 0) {
+        unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {};
+        const size_t bits = 8 * sizeof(unsigned long);
+        mask[cmd.mem_node / bits] |= 1UL << (cmd.mem_node % bits);
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, mask, sizeof(mask) * 8) < 0) child_perror("place: set_mempolicy");
+    }
+}
+
+// ---------- Cgroups ----------
+// A `limit` job runs in a cgroup v2 leaf of its own under the shell's
+// cgroup, with memory.max, cpu.max and io.max written before any stage
+// starts. Stages are cloned straight into it (clone3 with
+// CLONE_INTO_CGROUP), so they are contained from their first instruction
+// at no extra cost per launch, and everything they start stays inside. The
+// leaf goes away with the job, after killing whatever the job left behind.
+static std::string cgroup_parent;               // where job leaves are made
+static std::string cgroup_controllers;          // enabled for the leaves
+static std::vector<std::string> cgroup_busy;    // leaves rmdir found busy
+static unsigned cgroup_seq = 0;
+
+static bool write_file(const std::string &path, std::string_view text) {
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t n = write(fd, text.data(), text.size());
+    int err = errno;
+    close(fd);
+    errno = err;
+    return n == static_cast<ssize_t>(text.size());
+}
+
+static bool has_word(const std::string &list, const std::string &word) {
+    std::istringstream in(list);
+    for (std::string w; in >> w; ) if (w == word) return true;
+    return false;
+}
+
+// Finds the cgroup2 mount and the shell's cgroup in it, and turns on the
+// cpu, memory and io controllers for its children where the kernel offers
+// them. Only a cgroup without member processes (or the root) can hand
+// controllers down, so when that is refused the shell moves itself into a
+// `shell` leaf of its own cgroup and tries again.
+static bool cgroup_setup() {
+    static int state = 0;   // 0 untried, 1 ready, -1 no cgroup2
+    if (state) return state > 0;
+    state = -1;
+    std::string mount, line;
+    int fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    LineReader mounts(fd);
+    while (mount.empty() && mounts.next(line)) {
+        size_t sep = line.find(" - ");
+        if (sep == std::string::npos || line.compare(sep + 3, 8, "cgroup2 ") != 0) continue;
+        std::istringstream fields(line.substr(0, sep));
+        std::string f;
+        for (int k = 0; k < 5 && fields >> f; ++k) if (k == 4) mount = f;
+    }
+    close(fd);
+    if (mount.empty()) return false;
+    std::string self = read_small_file("/proc/self/cgroup");
+    size_t at = self.find("0::");
+    if (at == std::string::npos || (at > 0 && self[at - 1] != '\n')) return false;
+    std::string rel = self.substr(at + 3, self.find('\n', at) - at - 3);
+    cgroup_parent = mount + (rel == "/" ? "" : rel);
+
+    std::string offered = read_small_file(cgroup_parent + "/cgroup.controllers"), want;
+    for (const char *c : {"cpu", "memory", "io"})
+        if (has_word(offered, c)) want += std::string(want.empty() ? "+" : " +") + c;
+    if (!want.empty() && !write_file(cgroup_parent + "/cgroup.subtree_control", want) && errno == EBUSY) {
+        std::string leaf = cgroup_parent + "/shell";
+        if ((mkdir(leaf.c_str(), 0755) == 0 || errno == EEXIST) &&
+            write_file(leaf + "/cgroup.procs", std::to_string(getpid())))
+            write_file(cgroup_parent + "/cgroup.subtree_control", want);
+    }
+    cgroup_controllers = read_small_file(cgroup_parent + "/cgroup.subtree_control");
+    if (opt_debug)
+        std::cerr << "+ cgroup parent " << cgroup_parent << ", controllers: " << cgroup_controllers << "\n";
+    state = 1;
+    return true;
+}
+
+// Makes the leaf for a `limit` job and returns a directory fd for clone3,
+// or -1 with the error reported. `path` receives the leaf.
+static int cgroup_create(const JobLimits &lim, std::string &path) {
+    if (!cgroup_setup()) {
+        std::cerr << "limit: no cgroup v2 hierarchy found\n";
+        return -1;
+    }
+    path = cgroup_parent + "/mini-shell-" + std::to_string(getpid()) + "-" + std::to_string(++cgroup_seq);
+    if (mkdir(path.c_str(), 0755) < 0) {
+        std::cerr << "limit: " << path << ": " << std::strerror(errno) << "\n";
+        return -1;
+    }
+    struct { const char *file, *controller; std::string value; } caps[] = {
+        {"memory.max", "memory", lim.mem ? std::to_string(lim.mem) : ""},
+        {"cpu.max", "cpu", lim.cpu_quota ? std::to_string(lim.cpu_quota) + " " + std::to_string(cpu_period) : ""},
+        {"io.max", "io", lim.io ? lim.io : ""},
+    };
+    for (auto &c : caps) {
+        if (c.value.empty()) continue;
+        // A cap that can't be applied fails the job rather than running it uncontained
+        if (!has_word(cgroup_controllers, c.controller)) {
+            std::cerr << "limit: the " << c.controller << " controller is not available in " << cgroup_parent << "\n";
+            rmdir(path.c_str());
+            return -1;
+        }
+        if (!write_file(path + "/" + c.file, c.value)) {
+            std::cerr << "limit: " << c.file << " " << c.value << ": " << std::strerror(errno) << "\n";
+            rmdir(path.c_str());
+            return -1;
+        }
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "limit: " << path << ": " << std::strerror(errno) << "\n";
+        rmdir(path.c_str());
+        return -1;
+    }
+    if (opt_debug) std::cerr << "+ cgroup " << path << "\n";
+    return fd;
+}
+
+static void cgroup_remove(const std::string &path) {
+    for (size_t k = 0; k < cgroup_busy.size(); ) {
+        if (rmdir(cgroup_busy[k].c_str()) == 0 || errno != EBUSY) cgroup_busy.erase(cgroup_busy.begin() + k);
+        else ++k;
+    }
+    if (rmdir(path.c_str()) == 0 || errno != EBUSY) return;
+    // Something the job started is still running: the job's bounds are its
+    // cgroup's. The kill is asynchronous, so wait briefly for cgroup.events
+    // to report the leaf empty; a leaf still busy is retried next time.
+    write_file(path + "/cgroup.kill", "1");
+    int fd = open((path + "/cgroup.events").c_str(), O_RDONLY | O_CLOEXEC);
+    for (int tries = 0; fd >= 0 && tries < 10; ++tries) {
+        char buf[256];
+        ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+        if (n > 0) {
+            buf[n] = '\0';
+            if (strstr(buf, "populated 0")) break;
+        }
+        struct pollfd p = {fd, POLLPRI, 0};
+        poll(&p, 1, 20);
+    }
+    if (fd >= 0) close(fd);
+    if (rmdir(path.c_str()) != 0) cgroup_busy.push_back(path);
+}
+
+// CPU time of everything that ran in the leaf, and its peak memory when the
+// memory controller is on. False when the leaf can't be read.
+static bool cgroup_stats(const std::string &path, uint64_t &user_us, uint64_t &sys_us, uint64_t &peak) {
+    std::istringstream stat(read_small_file(path + "/cpu.stat"));
+    bool found = false;
+    for (std::string key; stat >> key; ) {
+        uint64_t v = 0;
+        stat >> v;
+        if (key == "user_usec") { user_us = v; found = true; }
+        else if (key == "system_usec") sys_us = v;
+    }
+    peak = strtoull(read_small_file(path + "/memory.peak").c_str(), nullptr, 10);
+    return found;
+}
+
+// ---------- Spawning ----------
+// Pipeline stages are started with posix_spawnp(), which glibc implements on
+// clone(CLONE_VM|CLONE_VFORK): the child borrows the shell's address space until
+// execve, so no page tables (readline state included) are copied per stage.
+// fork_stage() keeps the classic path as a fallback; SHELL_SPAWN=fork selects it.
+static bool spawn_use_fork = false;
+// The exit status a stage gets when the functions below fail to start it:
+// 127 when the command isn't found, 126 when it can't be run, 1 otherwise.
+static int stage_failure = 1;
+
+static void default_child_signals(sigset_t *set) {
+    sigemptyset(set);
+    for (int s : {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGPIPE}) sigaddset(set, s);
+}
+
+// A forked copy of the shell that goes on running shell code: SIGCHLD
+// stays blocked so it can still reap through the signal fd, everything
+// else gets the default disposition.
+static void subshell_signals() {
+    sigset_t defaults, unblock;
+    default_child_signals(&defaults);
+    sigdelset(&defaults, SIGCHLD);
+    for (int s = 1; s < NSIG; ++s) if (sigismember(&defaults, s) == 1) signal(s, SIG_DFL);
+    sigemptyset(&unblock);
+    sigaddset(&unblock, SIGINT);
+    sigprocmask(SIG_UNBLOCK, &unblock, nullptr);
+}
+
+// The shell's own descriptors are all close-on-exec; a stage additionally
+// drops anything above stderr it may have inherited from whoever started the
+// shell (one close_range call, however many fds there are), so it holds
+// exactly stdin, stdout and stderr.
+static void close_from(int lowfd) {
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, lowfd, ~0U, 0) == 0) return;
+#endif
+    for (long fd = lowfd, max = sysconf(_SC_OPEN_MAX); fd < max; ++fd) close(static_cast<int>(fd));
+}
+
+// close_from(), sparing the fds in `keep` (process substitution pipes,
+// the signal fd).
+static void close_from_except(int lowfd, const int *keep, int nkeep) {
+    int top = lowfd - 1;
+    for (int k = 0; k < nkeep; ++k) top = std::max(top, keep[k]);
+    for (int fd = lowfd; fd < top; ++fd)
+        if (std::find(keep, keep + nkeep, fd) == keep + nkeep) close(fd);
+    close_from(top + 1);
+}
+
+// The environment a stage is started with: the cached shell_envp(), or a
+// copy of it with the stage's NAME=value prefixes laid over it.
+static char **stage_envp(const Command &cmd, std::vector<char*> &scratch) {
+    char **envp = shell_envp();
+    if (cmd.nassigns == 0) return envp;
+    scratch.assign(cmd.assigns, cmd.assigns + cmd.nassigns);
+    for (char **e = envp; *e; ++e) {
+        const char *eq = strchr(*e, '=');
+        size_t len = eq ? eq - *e + 1 : strlen(*e);
+        bool replaced = false;
+        for (int a = 0; a < cmd.nassigns && !replaced; ++a) replaced = strncmp(cmd.assigns[a], *e, len) == 0;
+        if (!replaced) scratch.push_back(*e);
+    }
+    scratch.push_back(nullptr);
+    return scratch.data();
+}
+
+// The redirections of an external stage as a list of dup2/close steps for
+// the child. Files and here-documents are opened in the parent, so a bad
+// path is reported precisely instead of surfacing as an anonymous spawn
+// error, and are moved above the highest target fd so no step can clobber
+// a source a later one still needs. The steps run after the pipe ends are
+// in place: redirections win over the pipe, and `2>&1` sees the pipe.
+struct DupPlan {
+    struct Step { int src, fd; };        // src -1: close fd
+    std::vector<Step> steps;
+    std::vector<int> opened;
+    std::vector<int> keep;               // fds above stderr the stage ends up with
+    int top = STDERR_FILENO;
+
+    // False, with the error reported, if a file can't be opened or a `>&`
+    // source isn't open.
+    bool build(const Command &cmd, int in_fd, int out_fd) {
+        for (int n = 0; n < cmd.nredirs; ++n) top = std::max(top, cmd.redirs[n].fd);
+        int floor = std::max(10, top + 1);
+        for (int n = 0; n < cmd.nredirs; ++n) {
+            const Redirect &r = cmd.redirs[n];
+            if (r.kind == Redirect::Close) { steps.push_back({-1, r.fd}); continue; }
+            if (r.kind == Redirect::Dup) {
+                if (!source_ok(cmd, r.src, in_fd, out_fd)) { release(); return false; }
+                steps.push_back({r.src, r.fd});
+                continue;
+            }
+            int fd = open_redirect(r);
+            if (fd < 0) { release(); return false; }
+            int high = fcntl(fd, F_DUPFD_CLOEXEC, floor);
+            close(fd);
+            if (high < 0) { safe_perror("redirection"); release(); return false; }
+            opened.push_back(high);
+            steps.push_back({high, r.fd});
+        }
+        for (const Step &s : steps)
+            if (s.fd > STDERR_FILENO && std::find(keep.begin(), keep.end(), s.fd) == keep.end()) keep.push_back(s.fd);
+        keep.erase(std::remove_if(keep.begin(), keep.end(), [this](int fd) { return closed(fd); }), keep.end());
+        keep.insert(keep.end(), cmd.pass_fds, cmd.pass_fds + cmd.npass);
+        return true;
+    }
+
+    // Whether the last step for `fd` closes it.
+    bool closed(int fd) const {
+        for (auto s = steps.rbegin(); s != steps.rend(); ++s) if (s->fd == fd) return s->src < 0;
+        return false;
+    }
+
+    // A source is fine if an earlier step left it open, it's one of the
+    // stage's pipe ends, or the shell has it open for commands to use.
+    bool source_ok(const Command &cmd, int src, int in_fd, int out_fd) const {
+        for (auto s = steps.rbegin(); s != steps.rend(); ++s)
+            if (s->fd == src) {
+                if (s->src >= 0) return true;
+                std::cerr << src << ": Bad file descriptor\n";
+                return false;
+            }
+        if ((src == STDIN_FILENO && in_fd >= 0) || (src == STDOUT_FILENO && out_fd >= 0)) return true;
+        if (std::find(cmd.pass_fds, cmd.pass_fds + cmd.npass, src) != cmd.pass_fds + cmd.npass) return true;
+        return redirect_source_ok(src);
+    }
+
+    // In the child after fork(): nothing but dup2/close/fcntl.
+    void run() const {
+        for (const Step &s : steps) {
+            if (s.src < 0) close(s.fd);
+            else if (s.src != s.fd) dup2(s.src, s.fd);
+            else fcntl(s.fd, F_SETFD, 0);
+        }
+    }
+
+    void add_to(posix_spawn_file_actions_t *fa) const {
+        for (const Step &s : steps) {
+            if (s.src < 0) posix_spawn_file_actions_addclose(fa, s.fd);
+            else posix_spawn_file_actions_adddup2(fa, s.src, s.fd);
+        }
+    }
+
+    void release() {
+        for (int fd : opened) close(fd);
+        opened.clear();
+    }
+};
+
+pid_t fork_stage(Command &cmd, int in_fd, int out_fd, pid_t pgid, bool own_group, int cgroup_fd = -1);
+
+// `pgid` is the group to join (0 = start a new one); with own_group false the
+// stage stays in the shell's group, which is how non-interactive runs work.
+pid_t spawn_stage(Command &cmd, int in_fd, int out_fd, pid_t pgid, bool own_group) {
+#if !(defined(__GLIBC__) && __GLIBC_PREREQ(2, 34))
+    // Without addclosefrom_np, fds the shell holds without close-on-exec
+    // would reach the command; the fork path closes them itself.
+    return fork_stage(cmd, in_fd, out_fd, pgid, own_group);
+#endif
+    DupPlan plan;
+    if (!plan.build(cmd, in_fd, out_fd)) { stage_failure = 1; return -1; }
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    if (in_fd >= 0) posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+    if (out_fd >= 0) posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+    plan.add_to(&fa);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+    // Everything above the highest target goes, the opened files included,
+    // except the process substitution pipes: the gaps below the last one
+    // are closed fd by fd (closing one that isn't open is not an error).
+    std::vector<int> passed(cmd.pass_fds, cmd.pass_fds + cmd.npass);
+    std::sort(passed.begin(), passed.end());
+    int from = plan.top + 1;
+    for (int fd : passed) {
+        if (fd < from) continue;
+        for (; from < fd; ++from) posix_spawn_file_actions_addclose(&fa, from);
+        from = fd + 1;
+    }
+    posix_spawn_file_actions_addclosefrom_np(&fa, from);
+#endif
+    // Process substitution pipes go through exec under the same numbers,
+    // which the stage's arguments name.
+    for (int k = 0; k < cmd.npass; ++k) fcntl(cmd.pass_fds[k], F_SETFD, 0);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults, mask;
+    default_child_signals(&defaults);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (own_group) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid = -1;
+    std::string path;
+    bool cached = false;
+    int err = ENOENT;
+    std::vector<char*> env_scratch;
+    char **envp = stage_envp(cmd, env_scratch);
+    if (stage_command_path(cmd, path, cached)) {
+        err = posix_spawn(&pid, path.c_str(), &fa, &attr, cmd.argv, envp);
+        if (err != 0 && cached && is_stale_exec_error(err)) {
+            forget_command(cmd.argv[0]);
+            if (resolve_command(cmd.argv[0], path))
+                err = posix_spawn(&pid, path.c_str(), &fa, &attr, cmd.argv, envp);
+        }
+    } else {
+        std::cerr << cmd.argv[0] << ": command not found\n";
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    for (int k = 0; k < cmd.npass; ++k) fcntl(cmd.pass_fds[k], F_SETFD, FD_CLOEXEC);
+    plan.release();
+    if (err != 0) {
+        if (!path.empty()) std::cerr << cmd.argv[0] << ": " << std::strerror(err) << "\n";
+        stage_failure = path.empty() || err == ENOENT ? 127 : 126;
+        return -1;
+    }
+    return pid;
+}
+
+// fork(), or with a cgroup fd a child that starts out in that cgroup. A
+// child headed straight for execve is made with clone3(CLONE_INTO_CGROUP);
+// that bypasses glibc's fork handlers, so one that goes on running shell
+// code, or a kernel without clone3 (before 5.7), gets fork() and joins
+// through cgroup.procs before doing anything else.
+static pid_t fork_into(int cgroup_fd, bool execs) {
+    if (cgroup_fd < 0) return fork();
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    if (execs) {
+        struct clone_args args;
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = static_cast<uint64_t>(cgroup_fd);
+        long pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid >= 0) return static_cast<pid_t>(pid);
+        if (errno != ENOSYS && errno != E2BIG && errno != EINVAL) return -1;
+    }
+#else
+    (void)execs;
+#endif
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (fd < 0 || write(fd, "0", 1) != 1) { child_perror("limit: cgroup.procs"); _exit(126); }
+        close(fd);
+    }
+    return pid;
+}
+
+pid_t fork_stage(Command &cmd, int in_fd, int out_fd, pid_t pgid, bool own_group, int cgroup_fd) {
+    // Resolve in the parent so the lookup lands in the shared table.
+    std::string path;
+    bool cached = false;
+    if (!stage_command_path(cmd, path, cached)) {
+        std::cerr << cmd.argv[0] << ": command not found\n";
+        stage_failure = 127;
+        return -1;
+    }
+    if (cached && access(path.c_str(), X_OK) != 0) {
+        forget_command(cmd.argv[0]);
+        if (!resolve_command(cmd.argv[0], path)) {
+            std::cerr << cmd.argv[0] << ": command not found\n";
+            stage_failure = 127;
+            return -1;
+        }
+    }
+    std::vector<char*> env_scratch;
+    char **envp = stage_envp(cmd, env_scratch);
+    DupPlan plan;
+    if (!plan.build(cmd, in_fd, out_fd)) { stage_failure = 1; return -1; }
+    pid_t pid = fork_into(cgroup_fd, true);
+    if (pid < 0) { safe_perror("fork"); plan.release(); stage_failure = 1; return -1; }
+    if (pid == 0) {
+        if (own_group) setpgid(0, pgid);
+        apply_placement(cmd);
+        sigset_t defaults, none;
+        default_child_signals(&defaults);
+        for (int s = 1; s < NSIG; ++s) if (sigismember(&defaults, s) == 1) signal(s, SIG_DFL);
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
+
+        if (in_fd >= 0) dup2(in_fd, STDIN_FILENO);
+        if (out_fd >= 0) dup2(out_fd, STDOUT_FILENO);
+        plan.run();
+        close_from_except(STDERR_FILENO + 1, plan.keep.data(), static_cast<int>(plan.keep.size()));
+        for (int k = 0; k < cmd.npass; ++k) fcntl(cmd.pass_fds[k], F_SETFD, 0);
+
+        execve(path.c_str(), cmd.argv, envp);
+        child_perror("execve");
+        _exit(EXIT_FAILURE);
+    }
+    plan.release();
+    // Set the group from the parent too, so tcsetpgrp() can't race the child.
+    if (own_group) setpgid(pid, pgid ? pgid : pid);
+    return pid;
+}
+
+// A builtin that is a pipeline stage runs in a forked copy of the shell,
+// like a subshell: `cd` or `set` there doesn't touch the shell itself.
+pid_t fork_builtin(Command &cmd, int in_fd, int out_fd, pid_t pgid, bool own_group, int cgroup_fd = -1) {
+    std::cout.flush();
+    pid_t pid = fork_into(cgroup_fd, false);
+    if (pid < 0) { safe_perror("fork"); stage_failure = 1; return -1; }
+    if (pid == 0) {
+        if (own_group) setpgid(0, pgid);
+        apply_placement(cmd);
+        subshell_signals();
+        if (in_fd >= 0) dup2(in_fd, STDIN_FILENO);
+        if (out_fd >= 0) dup2(out_fd, STDOUT_FILENO);
+        // No exec follows, so close-on-exec doesn't help: drop the other
+        // pipe ends here or readers downstream would wait on us for EOF.
+        std::vector<int> keep(cmd.pass_fds, cmd.pass_fds + cmd.npass);
+        if (signal_event_fd() > STDERR_FILENO) keep.push_back(signal_event_fd());
+        if (telemetry) keep.push_back(telemetry->out_fd);
+        close_from_except(STDERR_FILENO + 1, keep.data(), static_cast<int>(keep.size()));
+        interactive = false;     // no job notices or terminal handling in the copy
+        SavedStdio io;
+        if (!io.apply(cmd)) _exit(1);
+        assign_vars(cmd);
+        last_status = 0;
+        builtin_execute(cmd.argc, cmd.argv);
+        std::cout.flush();
+        _exit(last_status);
+    }
+    if (own_group) setpgid(pid, pgid ? pgid : pid);
+    return pid;
+}
+
+// ---------- Zero-copy transfers ----------
+// `cat` stages that only concatenate files are done by the shell itself. A
+// bare `cat` inside a pipeline is dropped and its neighbours are joined
+// directly; a leading `cat file...` is moved into its destination with
+// copy_file_range (file to file), splice (into a pipe) or sendfile (anything
+// else), so the bytes never pass through a process or a userspace buffer.
+enum class CopyMethod { CopyFileRange, Splice, Sendfile, ReadWrite };
+
+// A ^C while the shell itself is copying: SIGINT is blocked in interactive
+// mode, so it shows up as pending and is consumed here.
+static bool copy_interrupted() {
+    sigset_t pending;
+    if (sigpending(&pending) < 0 || !sigismember(&pending, SIGINT)) return false;
+    sigset_t intr;
+    sigemptyset(&intr);
+    sigaddset(&intr, SIGINT);
+    struct timespec zero = {0, 0};
+    sigtimedwait(&intr, nullptr, &zero);
+    return true;
+}
+
+// Copies `src` to `dst` until EOF. Returns 0 or the errno that stopped it.
+static int copy_fd(int src, int dst) {
+    CopyMethod m = CopyMethod::Sendfile;
+    struct stat st;
+    if (fstat(dst, &st) == 0) {
+        if (S_ISFIFO(st.st_mode)) m = CopyMethod::Splice;
+        else if (S_ISREG(st.st_mode)) m = CopyMethod::CopyFileRange;
+    }
+    const size_t chunk = 1 << 20;
+    std::vector<char> buf;
+    for (;;) {
+        if (copy_interrupted()) return EINTR;
+        ssize_t n = -1;
+        switch (m) {
+        case CopyMethod::CopyFileRange:
+            n = copy_file_range(src, nullptr, dst, nullptr, chunk, 0);
+            break;
+        case CopyMethod::Splice:
+            n = splice(src, nullptr, dst, nullptr, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+            break;
+        case CopyMethod::Sendfile:
+            n = sendfile(dst, src, nullptr, chunk);
+            break;
+        case CopyMethod::ReadWrite:
+            if (buf.empty()) buf.resize(1 << 17);
+            n = read(src, buf.data(), buf.size());
+            for (ssize_t off = 0; n > 0 && off < n; ) {
+                ssize_t w = write(dst, buf.data() + off, n - off);
+                if (w < 0 && errno == EINTR) continue;
+                if (w < 0) return errno;
+                off += w;
+            }
+            break;
+        }
+        if (n > 0) continue;
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        // The kernel refuses some pairings (O_APPEND, a tty, a pipe as the
+        // source, a file system without support): nothing was consumed, so
+        // step down to the next method and carry on from the same offset.
+        bool refused = errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                       errno == EOPNOTSUPP || errno == EBADF;
+        if (m == CopyMethod::ReadWrite || !refused) return errno;
+        m = m == CopyMethod::Sendfile ? CopyMethod::ReadWrite : CopyMethod::Sendfile;
+    }
+}
+
+// The `<file` and `>file` of a stage whose redirections are no more than
+// that; false for anything else (other fds, dups, here-documents).
+static bool plain_redirects(const Command &cmd, const Redirect *&in, const Redirect *&out) {
+    in = out = nullptr;
+    for (int n = 0; n < cmd.nredirs; ++n) {
+        const Redirect &r = cmd.redirs[n];
+        if (r.kind != Redirect::Open) return false;
+        if (r.fd == STDIN_FILENO && !in && (r.flags & O_ACCMODE) == O_RDONLY) in = &r;
+        else if (r.fd == STDOUT_FILENO && !out && (r.flags & O_ACCMODE) == O_WRONLY) out = &r;
+        else return false;
+    }
+    return true;
+}
+
+// The operands of a `cat` the shell can do itself: plain file names, or none
+// with an input redirection. Options and `-` are left to the real cat.
+static bool copy_stage_sources(const Command &cmd, std::vector<const char*> &srcs) {
+    if (cmd.argc < 1 || strcmp(cmd.argv[0], "cat") != 0) return false;
+    const Redirect *in, *out;
+    if (!plain_redirects(cmd, in, out)) return false;
+    srcs.clear();
+    for (int i = 1; i < cmd.argc; ++i) {
+        if (cmd.argv[i][0] == '-') return false;
+        srcs.push_back(cmd.argv[i]);
+    }
+    if (!srcs.empty()) return in == nullptr;
+    if (!in) return false;
+    srcs.push_back(in->word);
+    return true;
+}
+
+// Drops bare `cat` stages (no operands, no redirections) from a pipeline of
+// two or more: the stage before writes straight into the stage after.
+// `elided` gets their original positions, in order.
+static void elide_plain_cats(std::vector<Command> &stages, std::vector<size_t> &elided) {
+    elided.clear();
+    for (size_t i = 0; i < stages.size() && stages.size() > 1; ) {
+        const Command &c = stages[i];
+        if (c.argc == 1 && strcmp(c.argv[0], "cat") == 0 && c.nredirs == 0) {
+            stages.erase(stages.begin() + i);
+            elided.push_back(i + elided.size());
+        } else {
+            ++i;
+        }
+    }
+}
+
+// Runs a copy stage in the shell into `feed` (the next stage's pipe, or -1
+// for stdout), honouring its output redirection. Closes `feed` when done and
+// returns the stage's exit status, reporting errors the way cat(1) does.
+static int run_copy_stage(const Command &cmd, const std::vector<const char*> &srcs, int feed) {
+    int dst = feed >= 0 ? feed : STDOUT_FILENO;
+    int out = -1;
+    const Redirect *in_redir, *out_redir;
+    plain_redirects(cmd, in_redir, out_redir);
+    if (out_redir) {
+        out = open_redirect(*out_redir);
+        if (out < 0) {
+            if (feed >= 0) close(feed);
+            return 1;
+        }
+        dst = out;
+    }
+    std::cout.flush();
+
+    int status = 0;
+    for (const char *src : srcs) {
+        int fd = open(src, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (in_redir && src == in_redir->word) safe_perror("open infile");
+            else std::cerr << "cat: " << src << ": " << std::strerror(errno) << "\n";
+            status = 1;
+            continue;
+        }
+        int err = copy_fd(fd, dst);
+        close(fd);
+        if (err == EPIPE) { status = 128 + SIGPIPE; break; }
+        if (err == EINTR) { status = 128 + SIGINT; break; }
+        if (err != 0) {
+            std::cerr << "cat: " << src << ": " << std::strerror(err) << "\n";
+            status = 1;
+        }
+    }
+    if (out >= 0) close(out);
+    if (feed >= 0) close(feed);
+    return status;
+}
+
+// ---------- Execution ----------
+// Every pipe is close-on-exec: a stage only keeps the ends that were dup2'ed
+// onto its stdin/stdout, so no per-child close loop is needed. `bufsize`
+// (0 = kernel default) is applied with F_SETPIPE_SZ, clamped to
+// fs.pipe-max-size when the request is over an unprivileged user's limit.
+static bool make_pipe(int fds[2], size_t bufsize) {
+    if (pipe2(fds, O_CLOEXEC) < 0) return false;
+    if (bufsize == 0) return true;
+    if (bufsize > INT_MAX) bufsize = INT_MAX;
+    int got = fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(bufsize));
+    if (got < 0 && errno == EPERM) {
+        static long max_size = -1;
+        if (max_size < 0) {
+            max_size = 0;
+            int fd = open("/proc/sys/fs/pipe-max-size", O_RDONLY | O_CLOEXEC);
+            char digits[32] = {};
+            if (fd >= 0) {
+                if (read(fd, digits, sizeof(digits) - 1) > 0) max_size = atol(digits);
+                close(fd);
+            }
+        }
+        if (max_size > 0) got = fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(max_size));
+    }
+    if (opt_debug) {
+        if (got < 0) std::cerr << "+ pipe " << fds[0] << "," << fds[1] << ": F_SETPIPE_SZ "
+                               << format_size(bufsize) << ": " << std::strerror(errno) << "\n";
+        else std::cerr << "+ pipe " << fds[0] << "," << fds[1] << ": " << format_size(got)
+                       << (static_cast<size_t>(got) != bufsize ? " (requested " + format_size(bufsize) + ")" : "")
+                       << "\n";
+    }
+    return true;
+}
+
+// Starts every stage of `pl` and returns the pids that started. With
+// own_group the stages join process group `pgid`, or a new one led by the
+// first stage when it is 0; either way `pgid` ends up naming the job.
+// `first_in` and `last_out`, when set, are the first stage's stdin and the
+// last stage's stdout. `failed`, when given, gets one entry per stage: -1
+// if it started, else the exit status it failed with.
+std::vector<pid_t> start_stages(Pipeline &pl, bool own_group, pid_t &pgid, int first_in = -1,
+                                int last_out = -1, std::vector<int> *failed = nullptr) {
+    Command *commands = pl.commands;
+    size_t n = pl.count;
+    std::vector<pid_t> pids;
+    std::vector<int> pipes;
+    pipes.resize((n > 0 ? n - 1 : 0) * 2);
+    if (failed) failed->assign(n, 1);
+
+    for (size_t i = 0; i + 1 < n; ++i) {
+        if (!make_pipe(&pipes[i*2], pl.pipebuf ? pl.pipebuf : opt_pipebuf)) {
+            perror("pipe");
+            for (size_t j = 0; j < i * 2; ++j) close(pipes[j]);
+            return pids;
+        }
+    }
+
+    if (script_stdin) script_stdin->release_unread();
+    std::cout.flush();
+
+    for (size_t i = 0; i < n; ++i) {
+        int in_fd = i > 0 ? pipes[(i-1)*2] : first_in;
+        int out_fd = i + 1 < n ? pipes[i*2 + 1] : last_out;
+        pid_t pid;
+        if (commands[i].argc == 0 || is_builtin_name(commands[i].argv[0]))
+            pid = fork_builtin(commands[i], in_fd, out_fd, pgid, own_group, pl.cgroup_fd);
+        else if (spawn_use_fork || pl.cgroup_fd >= 0 || commands[i].cpus || commands[i].mem_node >= 0)
+            pid = fork_stage(commands[i], in_fd, out_fd, pgid, own_group, pl.cgroup_fd);
+        else pid = spawn_stage(commands[i], in_fd, out_fd, pgid, own_group);
+        // A stage that failed to start is skipped; its neighbours see EOF/EPIPE.
+        if (failed) (*failed)[i] = pid < 0 ? stage_failure : -1;
+        if (pid < 0) continue;
+        if (pgid == 0) pgid = pid;
+        pids.push_back(pid);
+    }
+
+    for (size_t j = 0; j < pipes.size(); ++j) close(pipes[j]);
+    return pids;
+}
+
+// Pipes of the process substitutions in the pipeline being run. The shell
+// holds its ends until the pipeline has started and its in-shell stages
+// are done, then execute_pipeline() closes them.
+static std::vector<int> procsub_fds;
+
+// Starts the command of <(text) or >(text) (`writes`) on a new pipe and
+// hands back the shell's end in `fd`: the one the pipeline reads from, or
+// writes to. Its processes are not a job; they stay in the shell's group
+// and are reaped like any stray child.
+static bool start_procsub(const char *text, bool writes, Arena &arena, int &fd) {
+    Pipeline parsed, pl;
+    if (!parse_line(text, arena, parsed)) return false;
+    if (parsed.count == 0) {
+        std::cerr << (writes ? ">(" : "<(") << text << "): nothing to run\n";
+        return false;
+    }
+    if (!expand_pipeline(parsed, arena, pl)) return false;
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) { perror("pipe"); return false; }
+    pid_t pgid = 0;
+    int64_t started = now_ns();
+    std::vector<pid_t> pids = writes ? start_stages(pl, false, pgid, p[0], -1)
+                                     : start_stages(pl, false, pgid, -1, p[1]);
+    telemetry_stray_started(std::string(writes ? ">(" : "<(") + text + ")", pgid, pids, now_ns() - started);
+    close(writes ? p[0] : p[1]);
+    fd = writes ? p[1] : p[0];
+    procsub_fds.push_back(fd);
+    return true;
+}
+
+static void close_procsub_fds() {
+    for (int fd : procsub_fds) close(fd);
+    procsub_fds.clear();
+}
+
+void launch_pipeline(Pipeline &pl, const std::string &cmdline) {
+    bool background = pl.background;
+    // Without a terminal there is no job control: foreground stages stay in the
+    // shell's group. Background jobs still get one so fg/bg/killjob work.
+    bool own_group = interactive || background;
+    remove_finished_jobs();    // so their ids can be reused right away
+
+    // Trivial copies are taken out of a copy of the stage list, so `pl`
+    // itself stays as parsed. The shell only feeds a pipeline it can wait on
+    // without job control: with a terminal, ^Z could stop the reader while
+    // the shell is blocked writing to it. A `limit` or `place` job is all
+    // processes, in its cgroup or on its CPUs. `time` reports every stage
+    // as written, so a timed pipeline keeps its cats and has no in-shell
+    // stages.
+    std::vector<Command> stages(pl.commands, pl.commands + pl.count);
+    std::vector<size_t> elided;
+    if (!pl.timed) elide_plain_cats(stages, elided);
+    bool shell_free = !pl.limits && !pl.place;
+    std::vector<const char*> srcs;
+    bool shell_copy = !background && !pl.timed && shell_free && copy_stage_sources(stages[0], srcs) &&
+                      (stages.size() == 1 || !interactive);
+    Pipeline run = pl;
+    run.commands = stages.data() + (shell_copy ? 1 : 0);
+    run.count = stages.size() - (shell_copy ? 1 : 0);
+    // A utility builtin at the end of a foreground pipeline runs right here;
+    // it needs a process before it to read from, or it would be the copy's
+    // only reader and never drain it.
+    Command *shell_last = nullptr;
+    if (!background && !pl.timed && shell_free && run.count >= 2 && run.commands[run.count - 1].argc > 0 &&
+        is_utility_name(run.commands[run.count - 1].argv[0]))
+        shell_last = &run.commands[--run.count];
+
+    size_t pipebuf = pl.pipebuf ? pl.pipebuf : opt_pipebuf;
+    int feed[2] = {-1, -1}, tail[2] = {-1, -1};
+    // Nothing was started: drop the pipes and the process substitutions'
+    // ends, whose processes then see EOF or EPIPE.
+    auto abandon = [&] {
+        for (int fd : {feed[0], feed[1], tail[0], tail[1]}) if (fd >= 0) close(fd);
+        close_procsub_fds();
+        set_pipeline_status({1});
+    };
+    if ((shell_copy && run.count > 0 && !make_pipe(feed, pipebuf)) ||
+        (shell_last && !make_pipe(tail, pipebuf))) {
+        perror("pipe");
+        abandon();
+        return;
+    }
+    std::vector<cpu_set_t> cpu_sets;
+    if (pl.place && !place_stages(*pl.place, stages, cpu_sets)) {
+        abandon();
+        return;
+    }
+    std::string cgroup;
+    if (pl.limits && (run.cgroup_fd = cgroup_create(*pl.limits, cgroup)) < 0) {
+        abandon();
+        return;
+    }
+    pid_t pgid = 0;
+    std::vector<pid_t> pids;
+    std::vector<int> failed;
+    int64_t spawn_start = now_ns();
+    if (run.count > 0) pids = start_stages(run, own_group, pgid, feed[0], tail[1], &failed);
+    int64_t spawn_ns = now_ns() - spawn_start;
+    if (run.cgroup_fd >= 0) close(run.cgroup_fd);
+    if (feed[0] >= 0) close(feed[0]);
+    if (tail[1] >= 0) close(tail[1]);
+    // Like the real command, the builtin exits without draining the pipe:
+    // closing its end lets the stage before it see EPIPE. It goes before the
+    // shell copy, which would otherwise block on a pipeline nobody drains.
+    int last_builtin_status = 0;
+    if (shell_last) {
+        SavedStdio io;
+        TempAssigns temp;
+        last_status = 0;
+        temp.apply(*shell_last);
+        if (io.apply(*shell_last)) builtin_execute(shell_last->argc, shell_last->argv);
+        else last_status = 1;
+        io.restore();
+        temp.restore();
+        last_builtin_status = last_status;
+        close(tail[0]);
+    }
+    int copy_status = 0;
+    if (shell_copy) {
+        if (script_stdin) script_stdin->release_unread();
+        copy_status = run_copy_stage(stages[0], srcs, feed[1]);
+    }
+    // Stage statuses in pipeline order: the shell's copy, the processes (or
+    // why they didn't start), the in-shell last stage.
+    auto finish = [&](const Job *j) {
+        std::vector<int> codes;
+        if (shell_copy) codes.push_back(copy_status);
+        size_t proc = 0;
+        for (int f : failed) codes.push_back(f >= 0 ? f : exit_code(j->procs[proc++].status));
+        if (shell_last) codes.push_back(last_builtin_status);
+        for (size_t at : elided) codes.insert(codes.begin() + at, 0);   // a cat that was never run
+        set_pipeline_status(std::move(codes));
+    };
+    if (pids.empty()) {
+        if (!cgroup.empty()) cgroup_remove(cgroup);
+        if (background) set_pipeline_status({0});
+        else finish(nullptr);
+        return;
+    }
+    // Foreground jobs are in the table too, so the reaper can resolve their
+    // pids and a stopped job is already there for fg/bg.
+    Job &j = add_job(pgid, pids, cmdline, background, spawn_ns);
+    j.timed = pl.timed;
+    j.cgroup = cgroup;
+    if (background) {
+        set_pipeline_status({0});
+        last_bg_pid = pids.back();
+    }
+    else {
+        if (interactive) tcsetpgrp(STDIN_FILENO, pgid);
+        wait_for_job(j);
+        if (interactive) tcsetpgrp(STDIN_FILENO, shell_pgid);
+        if (!j.running && !j.stopped) {
+            finish(&j);
+            if (j.timed) {
+                print_time_report(j);
+                j.timed = false;
+            }
+        } else if (j.stopped) {
+            print_stopped_job(j);
+            set_pipeline_status({128 + SIGTSTP});
+        }
+    }
+    remove_finished_jobs();
+}
+
+// ---------- Parallel runner ----------
+// `parallel [-j N] template... [::: input...]` keeps up to N instances of the
+// template in flight, {} standing for the input (appended when absent).
+// Without ::: inputs are read from stdin, one per line. The whole run is one
+// job: the reaper starts the next input as soon as an instance finishes, so
+// it also progresses in the background and shows its progress in `jobs`.
+struct ParallelRun {
+    Arena arena;                   // template and per-input argv
+    Pipeline tmpl;
+    bool has_placeholder = false;
+    std::vector<std::string> inputs;
+    size_t max_jobs = 1;
+    size_t next = 0;               // next input to start
+    size_t active = 0;             // inputs in flight
+    size_t finished = 0;
+    size_t failed = 0;
+    bool cancelled = false;
+    std::vector<int> live;         // per input: stages still running
+    std::vector<size_t> last_proc; // per input: Job::procs index of its last stage
+    std::vector<int> codes;        // per input: exit code
+
+    bool pending() const { return active > 0 || (!cancelled && next < inputs.size()); }
+};
+
+static char *substitute_placeholder(Arena &arena, const char *word, std::string_view input) {
+    std::string_view w = word;
+    size_t at = w.find("{}");
+    if (at == std::string_view::npos) return const_cast<char*>(word);
+    std::string out;
+    size_t pos = 0;
+    for (; at != std::string_view::npos; at = w.find("{}", pos)) {
+        out.append(w.substr(pos, at - pos));
+        out.append(input);
+        pos = at + 2;
+    }
+    out.append(w.substr(pos));
+    return arena.copy(out);
+}
+
+// Builds the pipeline for input `k`. Template words are substituted as whole
+// argv entries, so inputs are never re-lexed.
+static Pipeline instantiate_template(ParallelRun &r, size_t k) {
+    Pipeline pl = r.tmpl;
+    pl.commands = r.arena.make_array<Command>(pl.count);
+    for (size_t i = 0; i < pl.count; ++i) {
+        const Command &t = r.tmpl.commands[i];
+        Command &c = pl.commands[i];
+        c = t;
+        bool append = !r.has_placeholder && i + 1 == pl.count;
+        c.argc = t.argc + (append ? 1 : 0);
+        c.argv = r.arena.make_array<char*>(c.argc + 1);
+        for (int a = 0; a < t.argc; ++a) c.argv[a] = substitute_placeholder(r.arena, t.argv[a], r.inputs[k]);
+        if (append) c.argv[t.argc] = r.arena.copy(r.inputs[k]);
+        if (t.nredirs > 0) {
+            c.redirs = r.arena.make_array<Redirect>(t.nredirs);
+            for (int n = 0; n < t.nredirs; ++n) {
+                c.redirs[n] = t.redirs[n];
+                if (t.redirs[n].kind == Redirect::Open)
+                    c.redirs[n].word = substitute_placeholder(r.arena, t.redirs[n].word, r.inputs[k]);
+            }
+        }
+    }
+    return pl;
+}
+
+static void parallel_refill(Job &j) {
+    ParallelRun &r = *j.run;
+    while (!r.cancelled && r.active < r.max_jobs && r.next < r.inputs.size()) {
+        size_t k = r.next++;
+        Pipeline pl = instantiate_template(r, k);
+        // Join the job's group while it still has members, else start a new one.
+        pid_t pgid = j.live > 0 ? j.pgid : 0;
+        std::vector<pid_t> pids = start_stages(pl, true, pgid);
+        if (pids.empty()) {
+            r.codes[k] = 127;
+            r.finished++;
+            r.failed++;
+            continue;
+        }
+        if (pgid != j.pgid) jobs.set_pgid(j, pgid);
+        for (pid_t pid : pids) jobs.add_process(j, pid).item = static_cast<int>(k);
+        r.live[k] = static_cast<int>(pids.size());
+        r.last_proc[k] = j.procs.size() - 1;
+        r.active++;
+    }
+}
+
+// Called by update_process() when a process of a `parallel` job exits.
+// Returns true while the run still has work, i.e. the job isn't done.
+bool parallel_item_exited(Job &j, size_t index) {
+    ParallelRun &r = *j.run;
+    int k = j.procs[index].item;
+    if (k >= 0 && --r.live[k] == 0) {
+        r.codes[k] = exit_code(j.procs[r.last_proc[k]].status);
+        if (r.codes[k] != 0) r.failed++;
+        r.finished++;
+        r.active--;
+        parallel_refill(j);
+    }
+    return r.pending();
+}
+
+void cancel_parallel(Job &j) {
+    if (j.run) j.run->cancelled = true;
+}
+
+std::string parallel_progress(const Job &j) {
+    const ParallelRun &r = *j.run;
+    return std::to_string(r.finished) + "/" + std::to_string(r.inputs.size()) + " done, " +
+           std::to_string(r.active) + " running, " + std::to_string(r.failed) + " failed";
+}
+
+void builtin_parallel(int argc, char **argv, bool background) {
+    auto run = std::make_shared<ParallelRun>();
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    run->max_jobs = ncpu > 0 ? static_cast<size_t>(ncpu) : 1;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        std::string_view opt = argv[i];
+        if (opt == "--") { ++i; break; }
+        const char *val = nullptr;
+        if (opt == "-j" || opt == "--jobs") val = i + 1 < argc ? argv[++i] : nullptr;
+        else if (opt.substr(0, 2) == "-j") val = argv[i] + 2;
+        else { std::cerr << "parallel: unknown option " << opt << "\n"; return; }
+        long n = val ? atol(val) : 0;
+        if (n <= 0) { std::cerr << "parallel: -j needs a positive number\n"; return; }
+        run->max_jobs = static_cast<size_t>(n);
+    }
+
+    int tmpl_begin = i;
+    while (i < argc && strcmp(argv[i], ":::") != 0) ++i;
+    int tmpl_end = i;
+    if (tmpl_begin == tmpl_end) {
+        std::cerr << "parallel: usage: parallel [-j N] command... [::: input...]\n";
+        return;
+    }
+
+    // A single word is a whole command line (pipes, redirections); several
+    // words are taken as argv as they are.
+    std::string cmdline = "parallel";
+    for (int a = 1; a < argc; ++a) cmdline += std::string(" ") + argv[a];
+    if (tmpl_end - tmpl_begin == 1) {
+        std::string_view text = run->arena.copy(argv[tmpl_begin]);
+        Pipeline parsed;
+        if (!parse_line(text, run->arena, parsed) || parsed.count == 0) return;
+        if (!expand_pipeline(parsed, run->arena, run->tmpl)) return;
+        run->tmpl.background = false;
+    } else {
+        Command *c = run->arena.make_array<Command>(1);
+        c->argc = tmpl_end - tmpl_begin;
+        c->argv = run->arena.make_array<char*>(c->argc + 1);
+        for (int a = 0; a < c->argc; ++a) c->argv[a] = run->arena.copy(argv[tmpl_begin + a]);
+        run->tmpl.commands = c;
+        run->tmpl.count = 1;
+    }
+    for (size_t c = 0; c < run->tmpl.count; ++c) {
+        const Command &cmd = run->tmpl.commands[c];
+        for (int a = 0; a < cmd.argc; ++a) if (strstr(cmd.argv[a], "{}")) run->has_placeholder = true;
+        for (int n = 0; n < cmd.nredirs; ++n)
+            if (cmd.redirs[n].kind == Redirect::Open && strstr(cmd.redirs[n].word, "{}")) run->has_placeholder = true;
+    }
+
+    if (tmpl_end < argc) {
+        for (int a = tmpl_end + 1; a < argc; ++a) run->inputs.push_back(argv[a]);
+    } else {
+        if (script_stdin) script_stdin->release_unread();
+        LineReader in(STDIN_FILENO);
+        for (std::string line; in.next(line); ) run->inputs.push_back(line);
+    }
+    size_t total = run->inputs.size();
+    run->live.assign(total, 0);
+    run->last_proc.assign(total, 0);
+    run->codes.assign(total, 0);
+
+    remove_finished_jobs();
+    Job &j = jobs.add(0, {}, cmdline, background);
+    j.run = run;
+    JobHandle h = jobs.handle(j);
+    parallel_refill(j);
+    if (background && interactive) std::cout << "[" << j.id << "] " << j.pgid << " started: " << cmdline << "\n";
+    if (!run->pending()) mark_job_done(j);
+    if (background) return;
+
+    // Foreground: the terminal stays with the shell, so Ctrl-C lands here
+    // and cancels the run instead of hitting just one instance.
+    while (jobs.get(h) && j.running) {
+        struct pollfd pfd = {signal_event_fd(), POLLIN, 0};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) { safe_perror("poll"); break; }
+        bool got_chld, got_int;
+        drain_signal_events(got_chld, got_int);
+        if (got_int) {
+            cancel_parallel(j);
+            if (j.pgid > 0 && j.live > 0) kill(-j.pgid, SIGINT);
+        }
+        if (got_chld) reap_children();
+    }
+    if (run->cancelled) std::cerr << "parallel: cancelled, " << run->finished << " of " << total << " jobs ran\n";
+    else if (run->failed) std::cerr << "parallel: " << run->failed << " of " << total << " jobs failed\n";
+    last_status = static_cast<int>(std::min<size_t>(run->failed, 101));
+    remove_finished_jobs();
+}
+
+// ---------- Coprocesses ----------
+// `coproc [NAME] command [args...]` starts a long-lived worker as a
+// background job, with its stdin and stdout on pipes held by the shell.
+// `coreq` then sends it a request line and prints the reply line. A
+// polling loop pays a pipe round trip per request this way, instead of a
+// fork and exec, and an interpreter in the loop starts up only once.
+// NAME defaults to COPROC, and $NAME_PID is set to the worker's pid.
+struct Coproc {
+    JobHandle job;
+    pid_t pid = 0;
+    int to = -1;          // worker's stdin
+    int from = -1;        // worker's stdout
+    std::string pending;  // read but not yet returned
+};
+static std::map<std::string, Coproc> coprocs;
+
+static bool coproc_alive(const Coproc &c) {
+    const Job *j = jobs.get(c.job);
+    return j && (j->running || j->stopped);
+}
+
+static void coproc_close(Coproc &c) {
+    if (c.to >= 0) close(c.to);
+    if (c.from >= 0) close(c.from);
+    c.to = c.from = -1;
+}
+
+static Coproc *find_coproc(const char *name, const char *who) {
+    auto it = coprocs.find(name);
+    if (it == coprocs.end()) {
+        std::cerr << who << ": " << name << ": no such coprocess\n";
+        return nullptr;
+    }
+    return &it->second;
+}
+
+// coproc                   list the coprocesses
+// coproc [NAME] command    start one (NAME only if it isn't a command)
+// coproc -c NAME           close its input, so it sees EOF and can finish
+void builtin_coproc(int argc, char **argv) {
+    if (argc == 1) {
+        for (auto &kv : coprocs) {
+            const Job *j = jobs.get(kv.second.job);
+            std::cout << kv.first << "\t" << kv.second.pid << "\t"
+                      << (coproc_alive(kv.second) ? "[" + std::to_string(j->id) + "] running" : "exited")
+                      << (kv.second.to < 0 ? ", input closed" : "") << "\n";
+        }
+        return;
+    }
+    if (strcmp(argv[1], "-c") == 0) {
+        if (argc != 3) { std::cerr << "coproc: usage: coproc -c NAME\n"; last_status = 2; return; }
+        Coproc *c = find_coproc(argv[2], "coproc");
+        if (!c) { last_status = 1; return; }
+        if (c->to >= 0) { close(c->to); c->to = -1; }
+        return;
+    }
+    int first = 1;
+    std::string name = "COPROC", path;
+    if (argc >= 3 && valid_name(argv[1]) && !is_builtin_name(argv[1]) && !resolve_command(argv[1], path)) {
+        name = argv[1];
+        first = 2;
+    }
+    auto it = coprocs.find(name);
+    if (it != coprocs.end()) {
+        if (coproc_alive(it->second)) {
+            std::cerr << "coproc: " << name << " is still running\n";
+            last_status = 1;
+            return;
+        }
+        coproc_close(it->second);
+        coprocs.erase(it);
+    }
+
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) < 0) { perror("pipe"); last_status = 1; return; }
+    if (pipe2(from, O_CLOEXEC) < 0) { perror("pipe"); close(to[0]); close(to[1]); last_status = 1; return; }
+    Command cmd;
+    cmd.argc = argc - first;
+    cmd.argv = argv + first;
+    Pipeline pl;
+    pl.commands = &cmd;
+    pl.count = 1;
+    remove_finished_jobs();
+    pid_t pgid = 0;
+    int64_t spawn_start = now_ns();
+    std::vector<pid_t> pids = start_stages(pl, true, pgid, to[0], from[1]);
+    int64_t spawn_ns = now_ns() - spawn_start;
+    close(to[0]);
+    close(from[1]);
+    if (pids.empty()) {
+        close(to[1]);
+        close(from[0]);
+        last_status = stage_failure;
+        return;
+    }
+    std::string cmdline = "coproc";
+    for (int a = 1; a < argc; ++a) cmdline += std::string(" ") + argv[a];
+    Job &j = add_job(pgid, pids, cmdline, true, spawn_ns);
+    Coproc &c = coprocs[name];
+    c.job = jobs.handle(j);
+    c.pid = pids.back();
+    c.to = to[1];
+    c.from = from[0];
+    last_bg_pid = c.pid;
+    var_set(name + "_PID", std::to_string(c.pid), false);
+}
+
+// Next line from the worker, without its newline. Waits next to the signal
+// fd, so children are still reaped and ^C gives up. Returns 0, or the
+// status to fail with.
+static int coproc_read_line(Coproc &c, std::string &line) {
+    char buf[65536];
+    while (true) {
+        size_t nl = c.pending.find('\n');
+        if (nl != std::string::npos) {
+            line.assign(c.pending, 0, nl);
+            c.pending.erase(0, nl + 1);
+            return 0;
+        }
+        if (c.from < 0) return 1;
+        struct pollfd fds[2] = {{c.from, POLLIN, 0}, {signal_event_fd(), POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            safe_perror("poll");
+            return 1;
+        }
+        if (fds[1].revents & POLLIN) {
+            bool got_chld, got_int;
+            drain_signal_events(got_chld, got_int);
+            if (got_chld) reap_children();
+            if (got_int && interactive) return 128 + SIGINT;
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        ssize_t n = read(c.from, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            close(c.from);
+            c.from = -1;
+            // A last reply without its newline still counts
+            if (c.pending.empty()) return 1;
+            line.swap(c.pending);
+            c.pending.clear();
+            return 0;
+        }
+        c.pending.append(buf, n);
+    }
+}
+
+// coreq [-n LINES] NAME [TEXT...]: sends TEXT as one line, then prints
+// LINES reply lines (default 1; 0 only sends). Without TEXT nothing is
+// sent, so replies can be read on their own.
+void builtin_coreq(int argc, char **argv) {
+    long lines = 1;
+    int i = 1;
+    if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+        char *end;
+        lines = strtol(argv[i + 1], &end, 10);
+        if (*end || lines < 0) { std::cerr << "coreq: -n needs a line count\n"; last_status = 2; return; }
+        i += 2;
+    }
+    if (i == argc) { std::cerr << "coreq: usage: coreq [-n LINES] NAME [TEXT...]\n"; last_status = 2; return; }
+    const char *name = argv[i++];
+    Coproc *c = find_coproc(name, "coreq");
+    if (!c) { last_status = 1; return; }
+    // Forked copies of the shell (a builtin inside a pipeline) drop every
+    // inherited descriptor, the coprocess pipes included.
+    if ((c->to >= 0 && fcntl(c->to, F_GETFD) < 0) || (c->from >= 0 && fcntl(c->from, F_GETFD) < 0)) {
+        std::cerr << "coreq: " << name << ": only usable from the shell itself, not inside a pipeline\n";
+        last_status = 1;
+        return;
+    }
+    if (i < argc) {
+        std::string req = argv[i];
+        for (int a = i + 1; a < argc; ++a) req += std::string(" ") + argv[a];
+        req += '\n';
+        if (c->to < 0) { std::cerr << "coreq: " << name << ": input is closed\n"; last_status = 1; return; }
+        for (size_t off = 0; off < req.size(); ) {
+            ssize_t w = write(c->to, req.data() + off, req.size() - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) {
+                std::cerr << "coreq: " << name << ": " << std::strerror(errno) << "\n";
+                last_status = 1;
+                return;
+            }
+            off += w;
+        }
+    }
+    std::string line;
+    for (long k = 0; k < lines; ++k) {
+        int rc = coproc_read_line(*c, line);
+        if (rc) {
+            if (rc == 1) std::cerr << "coreq: " << name << ": no reply, worker closed its output\n";
+            last_status = rc;
+            return;
+        }
+        std::cout << line << "\n";
+    }
+    std::cout.flush();
+}
+
+// ---------- History ----------
+// History persists in two append-only files shared by every shell: the
+// entries themselves, one per line, and an index of fixed-size records
+// pointing into them. Both are mmap'd, so startup cost doesn't grow with
+// the history: the last HISTSIZE entries are handed to readline straight
+// from the mapping, and searches run over it without parsing anything.
+// Appends take an flock on the data file, which is also what makes the
+// consecutive-duplicate check safe between several shells.
+struct HistRecord {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t hash;
+};
+static_assert(sizeof(HistRecord) == 16, "index records are written raw");
+
+static uint32_t fnv1a(std::string_view s) {
+    uint32_t h = 2166136261u;
+    for (unsigned char c : s) h = (h ^ c) * 16777619u;
+    return h;
+}
+
+class HistoryFile {
+public:
+    bool open(const std::string &path) {
+        data_fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (data_fd_ < 0) return false;
+        idx_fd_ = ::open((path + ".idx").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (idx_fd_ < 0) { close(data_fd_); data_fd_ = -1; return false; }
+        flock(data_fd_, LOCK_EX);
+        repair();
+        flock(data_fd_, LOCK_UN);
+        remap();
+        return true;
+    }
+
+    bool is_open() const { return data_fd_ >= 0; }
+    size_t size() const { return count_; }
+    size_t last_appended() const { return last_appended_; }   // this shell's newest entry
+    std::string_view entry(size_t i) const { return {data_ + idx_[i].offset, idx_[i].len}; }
+
+    void append(std::string_view line) {
+        if (data_fd_ < 0) return;
+        flock(data_fd_, LOCK_EX);
+        struct stat ds, is;
+        if (fstat(data_fd_, &ds) < 0 || fstat(idx_fd_, &is) < 0) { flock(data_fd_, LOCK_UN); return; }
+        last_appended_ = is.st_size / sizeof(HistRecord);
+        if (same_as_last(line, is.st_size)) {
+            --last_appended_;
+        } else {
+            HistRecord rec{static_cast<uint64_t>(ds.st_size), static_cast<uint32_t>(line.size()), fnv1a(line)};
+            std::string buf(line);
+            buf += '\n';
+            if (write(data_fd_, buf.data(), buf.size()) == static_cast<ssize_t>(buf.size()))
+                if (write(idx_fd_, &rec, sizeof(rec)) != sizeof(rec)) { /* repaired on next open */ }
+        }
+        flock(data_fd_, LOCK_UN);
+    }
+
+    // Picks up entries other shells appended since the last look.
+    void remap() {
+        struct stat ds, is;
+        if (fstat(data_fd_, &ds) < 0 || fstat(idx_fd_, &is) < 0) return;
+        size_t data_len = ds.st_size, idx_len = is.st_size - is.st_size % sizeof(HistRecord);
+        if (data_len == data_len_ && idx_len == idx_len_) return;
+        unmap();
+        if (data_len == 0 || idx_len == 0) return;
+        void *d = mmap(nullptr, data_len, PROT_READ, MAP_SHARED, data_fd_, 0);
+        void *x = mmap(nullptr, idx_len, PROT_READ, MAP_SHARED, idx_fd_, 0);
+        if (d == MAP_FAILED || x == MAP_FAILED) {
+            if (d != MAP_FAILED) munmap(d, data_len);
+            if (x != MAP_FAILED) munmap(x, idx_len);
+            return;
+        }
+        data_ = static_cast<const char*>(d);
+        idx_ = static_cast<const HistRecord*>(x);
+        data_len_ = data_len;
+        idx_len_ = idx_len;
+        count_ = idx_len / sizeof(HistRecord);
+        // A record written after our fstat of the data file points past it
+        while (count_ > 0 && idx_[count_ - 1].offset + idx_[count_ - 1].len > data_len_) --count_;
+    }
+
+    // Newest-first entries containing `needle`, each distinct line once.
+    // The index is walked backwards in windows; memmem scans a window's
+    // bytes in one go and hits are mapped back to entries by offset.
+    std::vector<size_t> find_substring(std::string_view needle, size_t limit) {
+        remap();
+        std::vector<size_t> out;
+        std::unordered_set<std::string_view> seen;
+        std::vector<size_t> hits;
+        for (size_t hi = count_; hi > 0 && out.size() < limit; ) {
+            size_t lo = hi > 4096 ? hi - 4096 : 0;
+            const char *begin = data_ + idx_[lo].offset;
+            const char *end = data_ + idx_[hi - 1].offset + idx_[hi - 1].len;
+            hits.clear();
+            for (const char *p = begin; p < end; ) {
+                const void *m = memmem(p, end - p, needle.data(), needle.size());
+                if (!m) break;
+                uint64_t off = static_cast<const char*>(m) - data_;
+                auto rec = std::upper_bound(idx_ + lo, idx_ + hi, off,
+                                            [](uint64_t o, const HistRecord &r) { return o < r.offset; }) - 1;
+                // Bytes between records (a torn write) can match too; those
+                // hits, and ones running past the entry, don't count.
+                if (off + needle.size() <= rec->offset + rec->len) hits.push_back(rec - idx_);
+                // One hit per entry, and always forward past this match.
+                p = std::max(data_ + rec->offset + rec->len, static_cast<const char*>(m) + 1);
+            }
+            for (auto it = hits.rbegin(); it != hits.rend() && out.size() < limit; ++it)
+                if (seen.insert(entry(*it)).second) out.push_back(*it);
+            hi = lo;
+        }
+        return out;
+    }
+
+    // Entries containing the characters of `pattern` in order. Tighter
+    // matches rank first, then newer ones; each distinct line once.
+    std::vector<size_t> find_fuzzy(std::string_view pattern, size_t limit) {
+        remap();
+        std::vector<std::pair<size_t, size_t>> scored;    // (span, -index) ordering
+        std::unordered_set<std::string_view> seen;
+        for (size_t i = count_; i-- > 0; ) {
+            std::string_view e = entry(i);
+            size_t span = fuzzy_span(e, pattern);
+            if (span == std::string_view::npos || !seen.insert(e).second) continue;
+            scored.push_back({span, i});
+        }
+        std::stable_sort(scored.begin(), scored.end(),
+                         [](const auto &a, const auto &b) { return a.first < b.first; });
+        std::vector<size_t> out;
+        for (size_t k = 0; k < scored.size() && k < limit; ++k) out.push_back(scored[k].second);
+        return out;
+    }
+
+private:
+    // Length of the shortest window of `e` holding `pattern` as a
+    // subsequence (found greedily from each start), or npos.
+    static size_t fuzzy_span(std::string_view e, std::string_view pattern) {
+        if (pattern.empty()) return 0;
+        size_t best = std::string_view::npos;
+        for (size_t start = e.find(pattern[0]); start != std::string_view::npos;
+             start = e.find(pattern[0], start + 1)) {
+            size_t pos = start;
+            for (size_t k = 1; k < pattern.size() && pos != std::string_view::npos; ++k)
+                pos = e.find(pattern[k], pos + 1);
+            if (pos == std::string_view::npos) break;
+            best = std::min(best, pos - start + 1);
+        }
+        return best;
+    }
+
+    bool same_as_last(std::string_view line, off_t idx_size) {
+        if (idx_size < static_cast<off_t>(sizeof(HistRecord))) return false;
+        HistRecord last;
+        off_t at = idx_size - idx_size % sizeof(HistRecord) - sizeof(HistRecord);
+        if (pread(idx_fd_, &last, sizeof(last), at) != sizeof(last)) return false;
+        if (last.len != line.size() || last.hash != fnv1a(line)) return false;
+        std::string prev(last.len, '\0');
+        return pread(data_fd_, &prev[0], last.len, last.offset) == static_cast<ssize_t>(last.len) &&
+               prev == line;
+    }
+
+    // Under the lock at open: drop torn index records, index any complete
+    // lines the index doesn't cover yet, and cut off a torn last line.
+    void repair() {
+        struct stat ds, is;
+        if (fstat(data_fd_, &ds) < 0 || fstat(idx_fd_, &is) < 0) return;
+        off_t idx_size = is.st_size - is.st_size % sizeof(HistRecord);
+        uint64_t covered = 0;
+        while (idx_size > 0) {
+            HistRecord last;
+            if (pread(idx_fd_, &last, sizeof(last), idx_size - sizeof(last)) != sizeof(last)) break;
+            if (last.offset + last.len < static_cast<uint64_t>(ds.st_size)) { covered = last.offset + last.len + 1; break; }
+            idx_size -= sizeof(last);
+        }
+        if (idx_size != is.st_size && ftruncate(idx_fd_, idx_size) < 0) return;
+        if (covered >= static_cast<uint64_t>(ds.st_size)) return;
+
+        std::string tail(ds.st_size - covered, '\0');
+        if (pread(data_fd_, &tail[0], tail.size(), covered) != static_cast<ssize_t>(tail.size())) return;
+        std::vector<HistRecord> recs;
+        size_t start = 0;
+        for (size_t nl; (nl = tail.find('\n', start)) != std::string::npos; start = nl + 1) {
+            std::string_view line(tail.data() + start, nl - start);
+            recs.push_back({covered + start, static_cast<uint32_t>(line.size()), fnv1a(line)});
+        }
+        if (start < tail.size() && ftruncate(data_fd_, covered + start) < 0) return;
+        if (!recs.empty() && write(idx_fd_, recs.data(), recs.size() * sizeof(HistRecord)) < 0) { /* retried next open */ }
+    }
+
+    void unmap() {
+        if (data_) munmap(const_cast<char*>(data_), data_len_);
+        if (idx_) munmap(const_cast<HistRecord*>(idx_), idx_len_);
+        data_ = nullptr;
+        idx_ = nullptr;
+        data_len_ = idx_len_ = count_ = 0;
+    }
+
+    int data_fd_ = -1, idx_fd_ = -1;
+    const char *data_ = nullptr;
+    const HistRecord *idx_ = nullptr;
+    size_t data_len_ = 0, idx_len_ = 0, count_ = 0;
+    size_t last_appended_ = SIZE_MAX;
+};
+
+static HistoryFile history_file;
+
+// $HISTFILE, or ~/.mini_shell_history; the last $HISTSIZE entries (1000 by
+// default) go to readline for arrow keys and ^R.
+void history_init() {
+    std::string path;
+    if (const char *hf = getenv("HISTFILE")) path = hf;
+    else if (const char *home = getenv("HOME")) path = std::string(home) + "/.mini_shell_history";
+    if (path.empty() || !history_file.open(path)) return;
+#ifndef SHELL_NO_READLINE
+    const char *hs = getenv("HISTSIZE");
+    size_t keep = hs ? strtoul(hs, nullptr, 10) : 1000;
+    size_t n = history_file.size();
+    for (size_t i = n > keep ? n - keep : 0; i < n; ++i)
+        add_history(std::string(history_file.entry(i)).c_str());
+#endif
+}
+
+static void history_record(const std::string &line) {
+#ifndef SHELL_NO_READLINE
+    HIST_ENTRY *last = history_length > 0 ? history_get(history_base + history_length - 1) : nullptr;
+    if (!last || line != last->line) add_history(line.c_str());
+#endif
+    history_file.append(line);
+}
+
+// history [N]        the last N entries (20)
+// history -s TEXT    newest entries containing TEXT
+// history -f TEXT    fuzzy: TEXT's characters in order, tightest first
+void builtin_history(int argc, char **argv) {
+    const size_t limit = 20;
+    if (!history_file.is_open()) { std::cerr << "history: no history file\n"; return; }
+    auto show = [](size_t i) {
+        std::cout << std::setw(7) << i + 1 << "  " << history_file.entry(i) << "\n";
+    };
+    if (argc >= 3 && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "-f") == 0)) {
+        std::vector<std::string> words(argv + 2, argv + argc);
+        std::string text = join_tokens(words);
+        bool fuzzy = argv[1][1] == 'f';
+        // The search itself was just recorded; it is not an answer.
+        for (size_t i : fuzzy ? history_file.find_fuzzy(text, limit + 1) : history_file.find_substring(text, limit + 1))
+            if (i != history_file.last_appended()) show(i);
+        return;
+    }
+    if (argc >= 2 && argv[1][0] == '-') { std::cerr << "history: usage: history [N] | -s TEXT | -f TEXT\n"; return; }
+    history_file.remap();
+    size_t n = history_file.size();
+    size_t want = argc >= 2 ? strtoul(argv[1], nullptr, 10) : limit;
+    for (size_t i = n > want ? n - want : 0; i < n; ++i) show(i);
+}
+
+// ---------- Line cache ----------
+// Batch input repeats lines all the time (polling loops, generated scripts).
+// The parsed form of a line is kept in an LRU keyed by the line's text, each
+// entry owning a small arena, so a repeated line skips the lexer and parser
+// and the PATH lookups of its stages. Entries hold the form before
+// expansion: variables are read again on every run and need no
+// invalidation. Resolved paths are tied to exec_hash_generation; once the
+// exec hash drops anything the entry is parsed afresh.
+struct CachedLine {
+    std::string text;
+    Arena arena{512};
+    CommandList list;
+    uint64_t generation = 0;
+};
+
+static const size_t line_cache_size = 256;
+static std::list<CachedLine> line_cache;   // most recent first
+static std::unordered_map<std::string_view, std::list<CachedLine>::iterator> line_cache_index;
+
+// The parsed list for `line`, from the cache or freshly parsed into it;
+// nullptr after a parse error, which is not cached.
+static const CommandList *cached_parse(const std::string &line) {
+    auto it = line_cache_index.find(line);
+    if (it != line_cache_index.end()) {
+        auto entry = it->second;
+        if (entry->generation == exec_hash_generation) {
+            line_cache.splice(line_cache.begin(), line_cache, entry);
+            return &entry->list;
+        }
+        line_cache_index.erase(it);
+        line_cache.erase(entry);
+    }
+    line_cache.emplace_front();
+    CachedLine &e = line_cache.front();
+    e.text = line;
+    if (!parse_list(e.text, e.arena, e.list)) {
+        line_cache.pop_front();
+        return nullptr;
+    }
+    for (size_t p = 0; p < e.list.count; ++p) {
+        const Pipeline &pl = e.list.pipelines[p];
+        for (size_t k = 0; k < pl.count; ++k) {
+            Command &c = pl.commands[k];
+            if (c.argc == 0 || (c.raw && c.raw[0]) || is_builtin_name(c.argv[0])) continue;
+            std::string path;
+            if (resolve_command(c.argv[0], path) && path[0] == '/') c.exec_path = e.arena.copy(path);
+        }
+    }
+    e.generation = exec_hash_generation;
+    line_cache_index.emplace(e.text, line_cache.begin());
+    if (line_cache.size() > line_cache_size) {
+        line_cache_index.erase(line_cache.back().text);
+        line_cache.pop_back();
+    }
+    return &e.list;
+}
+
+// ---------- Command substitution ----------
+// $(cmd) and `cmd`. A simple command is run straight from the shell: one
+// of the builtins below, which only write output, runs in the shell itself
+// with stdout on a memfd, so `x=$(coreq W req)` costs no fork; an external
+// command is spawned onto a pipe like a pipeline stage. Anything else runs
+// in a forked copy of the shell, like a subshell, so `cd` or assignments
+// in it stay there. Pipe output is read into a buffer that doubles as it
+// fills, so a big capture takes a few large read() calls.
+static const char *const capture_builtins[] = {
+    "echo", "printf", "pwd", "test", "[", "true", "false", "coreq", "jobs", "help", "about", "times",
+};
+// The status of the last substitution since execute_pipeline() reset it,
+// -1 if there was none; `x=$(false)` takes it as its own.
+static int subst_status = -1;
+
+int run_string(const std::string &text);
+
+// Appends everything up to EOF on `fd`.
+static void read_all(int fd, std::string &out) {
+    size_t len = out.size();
+    out.resize(std::max<size_t>(len * 2, 1 << 16));
+    while (true) {
+        if (len == out.size()) out.resize(out.size() * 2);
+        ssize_t n = read(fd, &out[len], out.size() - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+    }
+    out.resize(len);
+}
+
+static int wait_status(pid_t pid) {
+    int st = 0;
+    struct rusage ru{};
+    while (wait4(pid, &st, 0, &ru) < 0 && errno == EINTR) {}
+    telemetry_stray_reaped(pid, st, ru);
+    return WIFSIGNALED(st) ? 128 + WTERMSIG(st) : WEXITSTATUS(st);
+}
+
+// A capture builtin, in the shell.
+static void capture_builtin(std::vector<char*> &argv, int fd, std::string &out, int &status) {
+    std::cout.flush();
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, STDOUT_FILENO);
+    last_status = 0;
+    builtin_execute(static_cast<int>(argv.size()) - 1, argv.data());
+    std::cout.flush();
+    if (saved >= 0) { dup2(saved, STDOUT_FILENO); close(saved); }
+    else close(STDOUT_FILENO);
+    std::cout.clear();
+    status = last_status;
+
+    off_t len = lseek(fd, 0, SEEK_CUR);
+    out.resize(len > 0 ? static_cast<size_t>(len) : 0);
+    for (size_t got = 0; got < out.size(); ) {
+        ssize_t n = pread(fd, &out[got], out.size() - got, static_cast<off_t>(got));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { out.resize(got); break; }
+        got += n;
+    }
+}
+
+// False when `text` isn't a simple command (no list, pipe, redirection,
+// prefix assignment or process substitution, and a name that needs no
+// expansion), before anything was run.
+static bool capture_simple(std::string_view text, std::string &out, int &status) {
+    Arena arena(256);
+    CommandList list;
+    if (!parse_list(text, arena, list)) { status = 2; return true; }
+    if (list.count != 1) return false;
+    const Pipeline &pl = list.pipelines[0];
+    if (pl.count != 1 || pl.background || pl.timed || pl.limits || pl.place) return false;
+    const Command &cmd = pl.commands[0];
+    if (cmd.argc == 0 || cmd.nassigns || cmd.nredirs || (cmd.raw && cmd.raw[0])) return false;
+    for (int w = 0; w < cmd.argc; ++w) if (cmd.raw && cmd.raw[w] >= RawProcIn) return false;
+    bool in_shell = std::find_if(std::begin(capture_builtins), std::end(capture_builtins),
+                                 [&](const char *name) { return strcmp(name, cmd.argv[0]) == 0; }) !=
+                    std::end(capture_builtins);
+    if (!in_shell && is_builtin_name(cmd.argv[0])) return false;
+
+    int fds[2] = {-1, -1};
+    if (in_shell) fds[1] = static_cast<int>(syscall(SYS_memfd_create, "command-substitution", MFD_CLOEXEC));
+    else if (pipe2(fds, O_CLOEXEC) < 0) fds[1] = -1;
+    if (fds[1] < 0) return false;
+
+    std::vector<std::string> fields;
+    bool expanded = true;
+    for (int w = 0; w < cmd.argc && expanded; ++w) {
+        if (!cmd.raw || !cmd.raw[w]) { fields.emplace_back(cmd.argv[w]); continue; }
+        if (const char *err = expand_word(cmd.argv[w], fields, true)) {
+            std::cerr << cmd.argv[w] << ": " << err << "\n";
+            expanded = false;
+        }
+    }
+    std::vector<char*> argv;
+    for (auto &f : fields) argv.push_back(&f[0]);
+    argv.push_back(nullptr);
+
+    if (!expanded) {
+        status = 1;
+    } else if (in_shell) {
+        capture_builtin(argv, fds[1], out, status);
+    } else {
+        Command run = cmd;
+        run.argv = argv.data();
+        run.argc = static_cast<int>(fields.size());
+        run.raw = nullptr;
+        int64_t started = now_ns();
+        pid_t pid = spawn_use_fork ? fork_stage(run, -1, fds[1], 0, false) : spawn_stage(run, -1, fds[1], 0, false);
+        if (pid > 0) telemetry_stray_started("$(" + std::string(text) + ")", pid, {pid}, now_ns() - started);
+        close(fds[1]);
+        fds[1] = -1;
+        read_all(fds[0], out);
+        status = pid < 0 ? stage_failure : wait_status(pid);
+    }
+    for (int fd : fds) if (fd >= 0) close(fd);
+    return true;
+}
+
+// False, with the error reported, when the copy couldn't be started.
+static bool capture_forked(std::string_view text, std::string &out, int &status) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) { safe_perror("pipe"); return false; }
+    std::string code(text);
+    std::cout.flush();
+    int64_t started = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        safe_perror("fork");
+        close(p[0]);
+        close(p[1]);
+        return false;
+    }
+    if (pid == 0) {
+        subshell_signals();
+        dup2(p[1], STDOUT_FILENO);
+        std::vector<int> keep;
+        if (signal_event_fd() > STDERR_FILENO) keep.push_back(signal_event_fd());
+        if (telemetry) keep.push_back(telemetry->out_fd);
+        close_from_except(STDERR_FILENO + 1, keep.data(), static_cast<int>(keep.size()));
+        interactive = false;
+        _exit(run_string(code));
+    }
+    telemetry_stray_started("$(" + code + ")", pid, {pid}, now_ns() - started);
+    close(p[1]);
+    read_all(p[0], out);
+    close(p[0]);
+    status = wait_status(pid);
+    return true;
+}
+
+// The output of `text` without its trailing newlines; the caller splits
+// it like any other unquoted expansion. Sets $?.
+static void command_subst(std::string_view text, std::string &out) {
+    out.clear();
+    int status = 1;
+    if (!capture_simple(text, out, status) && !capture_forked(text, out, status)) status = 1;
+    size_t end = out.find_last_not_of('\n');
+    out.resize(end == std::string::npos ? 0 : end + 1);
+    subst_status = last_status = status;
+}
+
+// ---------- Main loop ----------
+// Expands and runs one pipeline of a list, leaving its status in
+// last_status and pipe_status.
+static void execute_pipeline(const Pipeline &parsed, Arena &arena) {
+    struct ProcSubClose { ~ProcSubClose() { close_procsub_fds(); } } procsub_close;
+    Pipeline pl;
+    subst_status = -1;
+    if (!expand_pipeline(parsed, arena, pl)) { set_pipeline_status({1}); return; }
+
+    // Special-case: single builtin runs in the shell, with its redirections
+    // (unless `limit` or `place` applies to it)
+    if (pl.count == 1 && !pl.limits && !pl.place) {
+        Command &cmd = pl.commands[0];
+        if (cmd.argc == 0 && !pl.background) {
+            // Only assignments: they set shell variables
+            SavedStdio io;
+            bool ok = io.apply(cmd);
+            io.restore();
+            ok = ok && assign_vars(cmd);
+            set_pipeline_status({!ok ? 1 : subst_status >= 0 ? subst_status : 0});
+            return;
+        }
+        std::string_view cmdname = cmd.argc ? cmd.argv[0] : "";
+        if (cmdname == "rhino" || cmdname == "xsmax") {
+            show_easter_egg(cmdname);
+            return;
+        }
+        if (is_builtin_name(cmdname)) {
+            SavedStdio io;
+            if (!io.apply(cmd)) { set_pipeline_status({1}); return; }
+            TempAssigns temp;
+            temp.apply(cmd);
+            struct rusage ru_before;
+            int64_t started = now_ns();
+            if (pl.timed) getrusage(RUSAGE_SELF, &ru_before);
+            last_status = 0;
+            builtin_execute(cmd.argc, cmd.argv, pl.background);
+            if (pl.timed) print_builtin_time(started, ru_before);
+            temp.restore();
+            io.restore();
+            set_pipeline_status({last_status});
+            return;
+        }
+    }
+
+    launch_pipeline(pl, std::string(pl.text));
+    remove_finished_jobs();
+}
+
+void execute_line(const std::string &line) {
+    auto start = line.find_first_not_of(" \t");
+    if (start == std::string::npos) return;
+    auto end = line.find_last_not_of(" \t");
+    if (interactive) history_record(line.substr(start, end - start + 1));
+
+    // Expansions of this line; reset on every way out of this function
+    static Arena arena;
+    struct ArenaReset { ~ArenaReset() { arena.reset(); } } arena_reset;
+    const CommandList *list = cached_parse(line);
+    if (!list) { set_pipeline_status({2}); return; }
+    for (size_t k = 0; k < list->count; ++k) {
+        // A skipped pipeline keeps the status, so `a && b || c` runs c when
+        // either a or b failed.
+        ListOp op = k > 0 ? list->ops[k - 1] : ListOp::Seq;
+        if ((op == ListOp::And && last_status != 0) || (op == ListOp::Or && last_status == 0)) continue;
+        execute_pipeline(list->pipelines[k], arena);
+        // ^C stops the whole list, not just the pipeline it hit
+        if (last_status == 128 + SIGINT) break;
+    }
+}
+
+// Non-interactive mode: no prompt, no history, no terminal job control.
+// Background jobs are reaped between lines.
+int run_batch(LineReader &reader) {
+    std::string line;
+    while (reader.next(line)) {
+        read_heredoc_bodies(line, [&](std::string &more) { return reader.next(more); });
+        execute_line(line);
+        handle_signal_events();
+    }
+    std::cout.flush();
+    return last_status;
+}
+
+int run_string(const std::string &text) {
+    size_t pos = 0;
+    auto next = [&](std::string &line) {
+        if (pos > text.size()) return false;
+        size_t nl = text.find('\n', pos);
+        if (nl == std::string::npos) nl = text.size();
+        line.assign(text, pos, nl - pos);
+        pos = nl + 1;
+        return true;
+    };
+    std::string line;
+    while (next(line)) {
+        read_heredoc_bodies(line, next);
+        execute_line(line);
+        handle_signal_events();
+    }
+    std::cout.flush();
+    return last_status;
+}
+
+// The terminal, its signals, readline and the history are set up on the
+// first interactive read rather than at startup: -c strings and scripts
+// never touch any of it.
+static void terminal_init() {
+    static bool done = false;
+    if (done) return;
+    done = true;
+    shell_pgid = getpid();
+    if (setpgid(shell_pgid, shell_pgid) < 0) { /* ignore */ }
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+
+#ifndef SHELL_NO_READLINE
+    rl_catch_signals = 0;
+    rl_attempted_completion_function = custom_completion;
+#endif
+    history_init();
+}
+
+#ifdef SHELL_NO_READLINE
+// Reads one line from the terminal in cooked mode while polling signals
+// and the prompt worker. 1 with a line, 0 at end of input, -1 on error.
+static int read_input_line(const char *prompt, bool main_prompt, std::string &line) {
+    terminal_init();
+    input_prompt = prompt;
+    redraw_input_line();
+    line.clear();
+    at_prompt = true;
+    at_main_prompt = main_prompt;
+    int got = -1;
+    while (got < 0) {
+        struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}, {signal_event_fd(), POLLIN, 0},
+                                {prompt_event_fd(), POLLIN, 0}};
+        if (poll(fds, 3, notices_wait_ms()) < 0) {
+            if (errno == EINTR) continue;
+            safe_perror("poll");
+            break;
+        }
+        if (fds[1].revents & POLLIN) handle_signal_events();
+        if (fds[2].revents & POLLIN) {
+            if (main_prompt) prompt_refresh();
+            else { uint64_t n; if (read(fds[2].fd, &n, sizeof(n)) < 0) { /* nothing pending */ } }
+        }
+        if (notices_wait_ms() == 0) show_held_notices();
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        // Canonical mode hands over at most one line per read().
+        char buf[4096];
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            safe_perror("read");
+            break;
+        }
+        if (n == 0) got = line.empty() ? 0 : 1;
+        line.append(buf, n);
+        if (!line.empty() && line.back() == '\n') { line.pop_back(); got = 1; }
+    }
+    at_prompt = at_main_prompt = false;
+    return got;
+}
+#else
+// readline runs in callback mode so the loop can poll the terminal and the
+// signal fd together. The line handler only hands the line over; it runs
+// after the handler is removed, so the terminal is back in cooked mode.
+static bool line_ready = false;
+static char *ready_line = nullptr;
+
+static void on_input_line(char *line) {
+    ready_line = line;
+    line_ready = true;
+    rl_callback_handler_remove();
+}
+
+// Reads one line with readline while polling signals and the prompt
+// worker, whose late answers only redraw the main prompt, not a "> "
+// continuation. 1 with a line, 0 at end of input, -1 on error.
+static int read_input_line(const char *prompt, bool main_prompt, std::string &line) {
+    terminal_init();
+    line_ready = false;
+    at_prompt = true;
+    at_main_prompt = main_prompt;
+    rl_callback_handler_install(prompt, on_input_line);
+    while (!line_ready) {
+        struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0}, {signal_event_fd(), POLLIN, 0},
+                                {prompt_event_fd(), POLLIN, 0}};
+        if (poll(fds, 3, notices_wait_ms()) < 0) {
+            if (errno == EINTR) continue;
+            safe_perror("poll");
+            rl_callback_handler_remove();
+            at_prompt = at_main_prompt = false;
+            return -1;
+        }
+        if (fds[1].revents & POLLIN) handle_signal_events();
+        if (fds[2].revents & POLLIN) {
+            if (main_prompt) prompt_refresh();
+            else { uint64_t n; if (read(fds[2].fd, &n, sizeof(n)) < 0) { /* nothing pending */ } }
+        }
+        if (notices_wait_ms() == 0) show_held_notices();
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) rl_callback_read_char();
+    }
+    at_prompt = at_main_prompt = false;
+    if (!ready_line) return 0;
+    line = ready_line;
+    free(ready_line);
+    return 1;
+}
+#endif // SHELL_NO_READLINE
+
+int run_interactive() {
+    const char *user = getenv("USER");
+    prompt_user = user ? user : "user";
+    prompt_update_cwd();
+
+    while (true) {
+        prompt_branch_shown = prompt_branch(prompt_cwd);
+        std::string prompt = build_prompt(prompt_branch_shown);
+        flush_held_notices();
+        std::string line;
+        int got = read_input_line(prompt.c_str(), true, line);
+        if (got < 0) return 1;
+        if (got == 0) { std::cout << "\n"; break; }
+        read_heredoc_bodies(line, [](std::string &more) { return read_input_line("> ", false, more) > 0; });
+        execute_line(line);
+    }
+    return 0;
+}
+
+#ifndef SHELL_NO_MAIN
+static void usage() {
+    std::cerr << "usage: shell [-c command [name [arg...]] | script-file [arg...]]\n";
+}
+
+int main(int argc, char **argv) {
+    const char *spawn_mode = getenv("SHELL_SPAWN");
+    if (spawn_mode && strcmp(spawn_mode, "fork") == 0) spawn_use_fork = true;
+    // The shell writes into pipes itself (see run_copy_stage): a reader that
+    // exits early must show up as EPIPE, not kill the shell. Stages get the
+    // default disposition back through default_child_signals().
+    signal(SIGPIPE, SIG_IGN);
+    vars_init();
+    if (const char *sink = getenv("SHELL_TELEMETRY")) {
+        if (*sink) telemetry_open(sink);
+    }
+
+    // -c command [name [args...]] and script-file [args...] set $0 and $1...
+    if (argc >= 2 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) { usage(); return 2; }
+        if (argc >= 4) shell_name = argv[3];
+        positional.assign(argv + std::min(argc, 4), argv + argc);
+        interactive = false;
+        setup_signal_events(false);
+        return run_string(argv[2]);
+    }
+    if (argc >= 2) {
+        if (argv[1][0] == '-') { usage(); return 2; }
+        shell_name = argv[1];
+        positional.assign(argv + 2, argv + argc);
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { std::cerr << argv[1] << ": " << std::strerror(errno) << "\n"; return 127; }
+        interactive = false;
+        setup_signal_events(false);
+        LineReader reader(fd);
+        int rc = run_batch(reader);
+        close(fd);
+        return rc;
+    }
+    if (!isatty(STDIN_FILENO)) {
+        interactive = false;
+        setup_signal_events(false);
+        LineReader reader(STDIN_FILENO);
+        script_stdin = &reader;
+        return run_batch(reader);
+    }
+    setup_signal_events(true);
+    return run_interactive();
+}
+#endif // SHELL_NO_MAIN